@@ -0,0 +1,179 @@
+/// \file fileindex.c Playable file table in the reserved area of the SPI flash
+/*
+
+   A GPIO trigger opens its file with OpenFile(n), and the ROM FatOpenFile
+   scans the directory from the start and walks the cluster chain of the
+   file every time. The file index keeps, for each playable file, what
+   FatOpenFile leaves for the player: the file size, the short name and
+   the fragment list. It is written once to the last 4K sector of the
+   reserved area (FILE_INDEX_BLOCK) and then serves OpenFile(n) with two
+   short SPI reads, however many files the disk has.
+
+   The index also holds the file count, so a boot with an unchanged
+   disk skips the OpenFile(0xffff) directory scan altogether. The mapper
+   erases the index when the host first writes to the disk, so it is
+   rebuilt by FileIndexInit() after a USB session that changed anything.
+   A stamp of the first FAT and directory sectors also catches an image
+   written by other means, such as an eeprom programmer. Files the index
+   does not cover are opened through the ROM.
+
+   Index sector layout (words):
+   0     FILE_INDEX_MAGIC
+   1     number of files n
+   2..3  stamp, see FileSystemStamp()
+   4..   n entry offsets, 0 if the file must be opened through the ROM
+   entry file size (2), fileName (6), fragment count f, f fragments
+
+*/
+
+#include "system.h"
+
+#include <stdio.h>  // Standard io
+#include <stdlib.h> // VS_DSP Standard Library
+#include <vs1000.h> // VS1000B register definitions
+#include <minifat.h>  // Read Only Fat Filesystem
+#include <mapper.h> // Logical Disk
+#include <string.h> // memcpy etc
+#include <player.h> // VS1000B default ROM player
+
+#include <dev1000.h>
+
+#include "spiflash.h"
+#include "fileindex.h"
+
+#if USE_FILE_INDEX
+
+#define HEADER_WORDS 4
+#define ENTRY_WORDS 9 /* before the fragments */
+#define FRAGMENT_WORDS (sizeof (struct FRAGMENT))
+
+/* Files in the index on flash, 0 if there is none */
+u_int16 fileIndexFiles;
+__y u_int16 fileIndexEntry[ENTRY_WORDS];
+
+// Fletcher checksum of the boot sector and the first sectors of the FAT
+// and of the root directory. A format changes the volume serial number,
+// adding or removing a file changes the FAT and the directory.
+void FileSystemStamp (__y u_int16 * stamp)
+{
+  register u_int16 i, j, a = 0, b = 0;
+  u_int32 sector[3];
+
+  sector[0] = 0;
+  sector[1] = minifatInfo.fatStart;
+  sector[2] = minifatInfo.rootStart;
+  for (j = 0; j < 3; j++)
+  {
+    ReadDiskSector (minifatBuffer, sector[j]);
+    for (i = 0; i < 256; i++)
+    {
+      a += minifatBuffer[i];
+      b += a;
+    }
+  }
+  minifatInfo.currentSector = 0xffffffffUL; /* minifatBuffer overwritten */
+  stamp[0] = a;
+  stamp[1] = b;
+}
+
+// Build the index of files 0..totalFiles-1 in WORKSPACE and write it.
+// Each file is opened once through the ROM. Returns -1 if not written.
+s_int16 FileIndexBuild (u_int16 totalFiles)
+{
+  register u_int16 i;
+  register __y u_int16 *d = WORKSPACE + HEADER_WORDS + totalFiles;
+
+  memsetY (WORKSPACE, 0, 2048);
+  WORKSPACE[0] = FILE_INDEX_MAGIC;
+  WORKSPACE[1] = totalFiles;
+  FileSystemStamp (WORKSPACE + 2);
+  for (i = 0; i < totalFiles; i++)
+  {
+    register u_int16 f = 0;
+
+    if ((s_int16) Fat12OpenFile (i) >= 0)
+    {
+      return -1;
+    }
+    while (f < MAX_FRAGMENTS
+           && !(minifatFragments[f++].start & LAST_FRAGMENT))
+      ;
+    // A longer chain continues from the FAT, which the index can't do
+    if (!(minifatFragments[f - 1].start & LAST_FRAGMENT)
+        || d + ENTRY_WORDS + f * FRAGMENT_WORDS > WORKSPACE + 2048)
+    {
+      continue;
+    }
+    WORKSPACE[HEADER_WORDS + i] = d - WORKSPACE;
+    memcpyYY (d, (__y u_int16 *) & minifatInfo.fileSize, 2);
+    memcpyYY (d + 2, minifatInfo.fileName, 6);
+    d[8] = f;
+    memcpyYY (d + ENTRY_WORDS, (__y u_int16 *) minifatFragments,
+              f * FRAGMENT_WORDS);
+    d += ENTRY_WORDS + f * FRAGMENT_WORDS;
+  }
+  return FsMapSpiFlashWriteIndex ();
+}
+
+// Returns the number of playable files. Takes it from the index on
+// flash if that is of this disk, otherwise counts the files with
+// OpenFile(0xffff) and builds the index. Called after the file system
+// has been initialized, before the player needs mallocAreaY.
+u_int16 FileIndexInit (void)
+{
+  register __y u_int16 *h = fileIndexEntry;
+  register u_int16 totalFiles;
+
+  fileIndexFiles = 0;
+  FsMapSpiFlashReadIndex (0, h, HEADER_WORDS);
+  if (h[0] == FILE_INDEX_MAGIC && h[1] <= FILE_INDEX_FILES)
+  {
+    __y u_int16 *stamp = h + HEADER_WORDS;
+    FileSystemStamp (stamp);
+    if (stamp[0] == h[2] && stamp[1] == h[3])
+    {
+      do__not__puts ("disk unchanged");
+      fileIndexFiles = h[1];
+      return fileIndexFiles;
+    }
+  }
+  totalFiles = OpenFile (0xffffU);
+  if (totalFiles <= FILE_INDEX_FILES)
+  {
+    do__not__puts ("build file index");
+    if (!FileIndexBuild (totalFiles))
+    {
+      fileIndexFiles = totalFiles;
+    }
+  }
+  return totalFiles;
+}
+
+// OpenFile hook: open file n from the index if it is there, otherwise
+// through the ROM with the FAT12 subdirectory fix.
+auto u_int16 FileIndexOpenFile (register __c0 u_int16 n)
+{
+  register __y u_int16 *e = fileIndexEntry;
+  register u_int16 offset;
+
+  if (n >= fileIndexFiles)
+  {
+    return Fat12OpenFile (n);
+  }
+  FsMapSpiFlashReadIndex (HEADER_WORDS + n, e, 1);
+  offset = e[0];
+  if (!offset)
+  {
+    return Fat12OpenFile (n);
+  }
+  FsMapSpiFlashReadIndex (offset, e, ENTRY_WORDS);
+  FsMapSpiFlashReadIndex (offset + ENTRY_WORDS,
+                          (__y u_int16 *) minifatFragments,
+                          e[8] * FRAGMENT_WORDS);
+  memcpyYY ((__y u_int16 *) & minifatInfo.fileSize, e, 2);
+  memcpyYY (minifatInfo.fileName, e + 2, 6);
+  minifatInfo.filePos = 0;
+  minifatInfo.currentSector = 0xffffffffUL; /* nothing in minifatBuffer */
+  return 0xffffU; /* found, like FatOpenFile */
+}
+#endif /* USE_FILE_INDEX */
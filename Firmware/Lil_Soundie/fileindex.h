@@ -0,0 +1,21 @@
+/// \file fileindex.h Playable file table in the reserved area of the SPI flash
+#ifndef __FILEINDEX_H__
+#define __FILEINDEX_H__
+
+// Most files in the index. More fit in the 4K sector if they have few
+// fragments, but the GPIO triggers select at most 255 anyway.
+#define FILE_INDEX_FILES 255
+
+#ifdef ASM
+
+#else /*ASM*/
+#include <vstypes.h>
+
+extern u_int16 fileIndexFiles;
+
+u_int16 FileIndexInit (void);
+auto u_int16 FileIndexOpenFile (register __c0 u_int16 n);
+
+#endif /* elseASM */
+
+#endif /* !__FILEINDEX_H__ */
@@ -0,0 +1,46 @@
+/// \file hostsim.h Host (Unix) build prelude for compiling spiflash.c
+/*
+   This file is force-included (gcc -include) before spiflash.c when the
+   mapper is built for the host-side SPI flash simulator. It turns the
+   VSDSP-only memory qualifiers into nothing, routes PERIP() register
+   accesses to the simulator, and gives word-counted versions of the
+   X/Y memory copy functions.
+*/
+#ifndef __HOSTSIM_H__
+#define __HOSTSIM_H__
+
+/* System headers first, glibc uses __x as an identifier */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define __x
+#define __y
+
+/* Peripheral registers live in the simulator, not at real addresses */
+#define USEX(x) (*HostPerip((unsigned short)(x)))
+#define USEY(x) (*HostPerip((unsigned short)(x)))
+
+#include <vstypes.h>
+#include <mappertiny.h> /* pulls in mapperflash.h, which maps memcpyXY to memcpy */
+
+volatile u_int16 *HostPerip (u_int16 addr);
+
+/* VSDSP memory copies take word counts */
+#undef memcpyXY
+#undef memcpyYX
+#undef memcpyYY
+#undef memsetY
+#define memcpyXY(d, s, n) memcpy ((d), (s), (n) * sizeof (u_int16))
+#define memcpyYX(d, s, n) memcpy ((d), (s), (n) * sizeof (u_int16))
+#define memcpyYY(d, s, n) memcpy ((d), (s), (n) * sizeof (u_int16))
+
+static inline u_int16 *memsetY (u_int16 *d, u_int16 c, size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; i++)
+    d[i] = c;
+  return d;
+}
+
+#endif /* !__HOSTSIM_H__ */
@@ -0,0 +1,1236 @@
+/// \file spisim.c Host-side SPI NOR flash simulator and spiFlashMapper benchmark
+/*
+   Runs the mapper in spiflash.c unmodified on a Unix host against a
+   simulated 25-series SPI NOR flash, so changes to the write path can be
+   compared with numbers instead of a stopwatch.
+
+   Build and run from the Lil_Soundie directory:
+
+     gcc -O2 -o hostsim/spisim -include hostsim/hostsim.h -idirafter lib \
+         hostsim/spisim.c spiflash.c
+     hostsim/spisim [w25x16|at25sf041|w25q256]
+
+   The default build uses the first 8 MB of a bigger chip. Build it also
+   for the largest supported chip, which takes the 4-byte address paths
+   and puts the last logical block at flash block 65535, and run both
+   32 MB profiles:
+
+     gcc -O2 -DMAX_CHIP_BLOCKS=65536 -o hostsim/spisim32 \
+         -include hostsim/hostsim.h -idirafter lib hostsim/spisim.c spiflash.c
+     hostsim/spisim32 w25q256
+     hostsim/spisim32 mx25l256
+
+   The simulated chip decodes the byte stream clocked by SpiSendReceive()
+   with xCS taken from the SPI0_CONFIG FSIDLE bit, and implements READ,
+   FAST READ, PAGE PROGRAM, 4K/32K/64K/chip ERASE, erase suspend and
+   resume, write enable, SFDP, the 4-byte address commands or mode and
+   the status register with
+   busy times from a chip profile. Page programs only clear
+   bits, as on real NOR flash. Commands sent while the chip is busy or
+   without write enable are counted as protocol errors. Reads clocked
+   faster than the profile allows return data sampled one bit late.
+
+   Modeled time is the SPI clock time of every transfer plus a fixed
+   per-call software overhead plus the time spent polling busy status,
+   plus USB_PACKET_NS for every 64-byte bulk packet of the host. Like the
+   USB loop in spiusb.c, FsMapSpiFlashStep() is called once per packet.
+   The USB hardware moves the packet meanwhile, so a packet takes the
+   longer of USB_PACKET_NS and the time spent in FsMapSpiFlashStep(),
+   and flash work done between packets overlaps the transfer. Host
+   latency between commands is not modeled.
+
+   Every workload finishes with a hard flush and a full compare of the
+   logical disk against a shadow copy and of the reserved blocks against
+   the boot image, so a broken mapper change fails here before it
+   reaches hardware. Host reads are compared as well, which in
+   write-read and bus-reset happen before anything has been flushed.
+*/
+
+#include <vs1000.h>
+#include <mapper.h>
+#include <player.h>
+#include <audio.h>
+#include <vectors.h> /* USB registers */
+#include <scsi.h>
+
+#include "../system.h"
+#include "../spiflash.h"
+
+/* Software overhead of one SpiSendReceive() call at 48 MHz */
+#define SPI_CALL_OVERHEAD_NS 250
+#define CORE_CLOCK_HZ 48000000.0
+
+/* Time an erase takes to suspend */
+#define SUSPEND_US 20
+
+/* One 64-byte full speed bulk packet, about 800 kB/s */
+#define USB_PACKET_NS 80000
+
+#define MAX_CHIP_BYTES (32L * 1024L * 1024L)
+
+struct ChipProfile
+{
+  const char *name;
+  u_int32 bytes;
+  u_int16 jedecId[3];
+  u_int32 tPageProgramUs;
+  u_int32 tWriteStatusUs;
+  u_int32 tErase4KUs;
+  u_int32 tErase32KUs;
+  u_int32 tErase64KUs;
+  u_int32 tEraseChipUs;
+  u_int32 readMHz;  /* fastest clock for READ */
+  u_int32 fastReadMHz;  /* fastest clock for FAST READ */
+  u_int16 bfptDwords; /* SFDP basic flash parameter table, 0: no SFDP */
+  u_int32 bfpt[13];
+  u_int16 fourByteCommands; /* takes 13h, 0Ch, 12h, 21h, 5Ch, DCh */
+  u_int32 fourBait[2];  /* 4-byte address instruction table, 0: none */
+};
+
+/*
+   Typical datasheet figures. The parameter tables give the density,
+   the address modes (DWORD 1 bits 18:17), the erase types (DWORDs 8
+   and 9: size exponent, opcode), the page size (DWORD 11) and whether
+   erases can be suspended, with which commands (DWORDs 12, 13). The
+   4-byte address instruction table lists the 4-byte read, program and
+   erase commands (DWORD 1) and the erase opcodes by type (DWORD 2).
+   mx25l256 has no such table and no 4-byte commands: it has to be put
+   to 4-byte address mode with B7h.
+*/
+static const struct ChipProfile profiles[] = {
+  {"w25x16", 2048L * 1024L, {0xef, 0x30, 0x15},
+   1500, 10000, 150000, 0, 1000000, 25000000, 33, 75, 0},
+  {"at25sf041", 512L * 1024L, {0x1f, 0x84, 0x01},
+   400, 8000, 45000, 120000, 200000, 1500000, 70, 104,
+   9, {0xfff120e5, 0x003fffff, 0, 0, 0, 0, 0, 0x520f200c, 0x0000d810}},
+  {"w25q256", 32L * 1024L * 1024L, {0xef, 0x40, 0x19},
+   700, 10000, 45000, 120000, 150000, 80000000, 50, 104,
+   13, {0xfff320e5, 0x0fffffff, 0, 0, 0, 0, 0, 0x520f200c, 0x0000d810,
+        0, 0x00000080, 0x00000000, 0x757a757a}, 1, {0x00000e43, 0xffdc5c21}},
+  {"mx25l256", 32L * 1024L * 1024L, {0xc2, 0x20, 0x19},
+   600, 10000, 45000, 150000, 250000, 80000000, 50, 104,
+   9, {0xfff320e5, 0x0fffffff, 0, 0, 0, 0, 0, 0x520f200c, 0x0000d810}},
+};
+
+static const struct ChipProfile *chip;
+
+/* simulated flash */
+static unsigned char flash[MAX_CHIP_BYTES];
+static unsigned char bootImage[RESERVED_BLOCKS * 512];
+static unsigned char pageBuffer[256];
+static u_int16 pageBufferUsed[256];
+
+static volatile u_int16 perip[0x10000];
+static u_int16 lastSpiConfig = SPI_CF_FSIDLE1;
+static int csActive;
+static int cmdBytes;
+static u_int16 opcode;
+static u_int32 address;
+static u_int16 writeEnable;
+static u_int16 statusWrite;
+static u_int16 addrBytes;
+static u_int16 addr4Mode; /* B7h given */
+static unsigned long long nowNs;
+static unsigned long long busyUntilNs;
+static int busyErasing;
+static unsigned long long suspendedNs; /* erase time left, 0: none */
+static double spiClockHz;
+static unsigned char lastIn;
+
+struct SimStats
+{
+  u_int32 erase4K, erase32K, erase64K, eraseChip;
+  u_int32 pagePrograms;
+  u_int32 statusWrites;
+  u_int32 readCommands;
+  unsigned long long bytesRead;
+  unsigned long long spiBytes;
+  unsigned long long busyNs;
+  unsigned long long stallNs; /* longest time the USB loop was held off */
+  u_int32 protocolErrors;
+};
+static struct SimStats st;
+static u_int16 sectorErases[MAX_CHIP_BYTES / 4096];
+static u_int16 resetOnErase; /* USB bus reset right after the next erase */
+
+/* ROM / linker symbols the mapper uses */
+__y u_int16 mallocAreaY[9216];
+struct SCSIVARS SCSI;
+
+void USBHandler (void)
+{
+  perip[USB_STATUS] &= ~USB_STF_BUS_RESET;
+}
+
+s_int16 FsMapFlNullOk ()
+{
+  return 0;
+}
+
+u_int32 ReadTimeCount (void)
+{
+  return (u_int32) (nowNs / (1000000000ULL / TIMER_TICKS));
+}
+
+
+static int ChipBusy (void)
+{
+  return nowNs < busyUntilNs;
+}
+
+static void StartBusy (u_int32 us)
+{
+  busyUntilNs = nowNs + us * 1000ULL;
+  busyErasing = 0;
+}
+
+static void EraseRange (u_int32 addr, u_int32 bytes, u_int32 us)
+{
+  u_int32 i;
+  addr &= ~(bytes - 1);
+  memset (flash + addr, 0xff, bytes);
+  for (i = addr / 4096; i < (addr + bytes) / 4096; i++)
+    sectorErases[i]++;
+  StartBusy (us);
+  busyErasing = 1;
+  if (resetOnErase)
+  {
+    resetOnErase = 0;
+    perip[USB_STATUS] |= USB_STF_BUS_RESET;
+  }
+}
+
+/* SFDP area: header, one parameter header, the basic table at 0x30 */
+static unsigned char SfdpByte (u_int32 addr)
+{
+  u_int32 d;
+  if (!chip->bfptDwords)
+    return 0xff;
+  if (addr < 8)
+    return addr == 6 ? (chip->fourBait[0] != 0)
+      : (unsigned char) ("SFDP\x06\x01\x00\xff"[addr]);
+  if (addr < 16)
+  {
+    static const unsigned char ph[8] = {0x00, 0x06, 0x01, 0, 0x30, 0, 0, 0xff};
+    return addr == 11 ? chip->bfptDwords : ph[addr - 8];
+  }
+  if (addr < 24 && chip->fourBait[0])
+  {
+    static const unsigned char ph[8] = {0x84, 0x00, 0x01, 2, 0x80, 0, 0, 0xff};
+    return ph[addr - 16];
+  }
+  if (addr >= 0x80 && addr < 0x88 && chip->fourBait[0])
+    return (unsigned char) (chip->fourBait[(addr - 0x80) / 4] >> (8 * (addr & 3)));
+  if (addr < 0x30 || addr >= 0x30 + 4 * chip->bfptDwords)
+    return 0xff;
+  d = chip->bfpt[(addr - 0x30) / 4];
+  return (unsigned char) (d >> (8 * (addr & 3)));
+}
+
+/* Operations that take effect on the rising edge of xCS */
+static void CsRise (void)
+{
+  if (!csActive)
+    return;
+  csActive = 0;
+  if (cmdBytes == 0)
+    return;
+  if (suspendedNs && (opcode == 0x01 || opcode == 0x20 || opcode == 0x52
+                      || opcode == 0xd8 || opcode == 0x60 || opcode == 0xc7))
+  { /* not taken while an erase is suspended */
+    st.protocolErrors++;
+    return;
+  }
+  switch (opcode)
+  {
+  case 0x01: /* write status register */
+    if (cmdBytes >= 2 && writeEnable)
+    {
+      st.statusWrites++;
+      writeEnable = 0;
+      StartBusy (chip->tWriteStatusUs);
+    }
+    break;
+  case 0x02: /* page program */
+    if (cmdBytes >= addrBytes + 2)
+    {
+      if (!writeEnable)
+      {
+        st.protocolErrors++;
+        break;
+      }
+      {
+        u_int32 base = address & ~255UL;
+        int i;
+        for (i = 0; i < 256; i++)
+        {
+          if (pageBufferUsed[i])
+            flash[base + i] &= pageBuffer[i];
+        }
+      }
+      st.pagePrograms++;
+      writeEnable = 0;
+      StartBusy (chip->tPageProgramUs);
+    }
+    break;
+  case 0x20: /* 4K sector erase */
+  case 0x52: /* 32K block erase */
+  case 0xd8: /* 64K block erase */
+    if (cmdBytes == addrBytes + 1)
+    {
+      if (!writeEnable)
+      {
+        st.protocolErrors++;
+        break;
+      }
+      if (opcode == 0x20)
+      {
+        st.erase4K++;
+        EraseRange (address, 4096, chip->tErase4KUs);
+      }
+      else if (opcode == 0x52 && chip->tErase32KUs)
+      {
+        st.erase32K++;
+        EraseRange (address, 32768, chip->tErase32KUs);
+      }
+      else if (opcode == 0xd8)
+      {
+        st.erase64K++;
+        EraseRange (address, 65536, chip->tErase64KUs);
+      }
+      else
+      {
+        st.protocolErrors++;
+      }
+      writeEnable = 0;
+    }
+    break;
+  case 0x60:
+  case 0xc7: /* chip erase */
+    if (!writeEnable)
+    {
+      st.protocolErrors++;
+      break;
+    }
+    st.eraseChip++;
+    EraseRange (0, chip->bytes, chip->tEraseChipUs);
+    writeEnable = 0;
+    break;
+  }
+}
+
+static void SyncChipSelect (void)
+{
+  u_int16 cfg = perip[SPI0_CONFIG];
+  if (cfg != lastSpiConfig)
+  {
+    if ((cfg & SPI_CF_FSIDLE1) && !(lastSpiConfig & SPI_CF_FSIDLE1))
+      CsRise ();
+    lastSpiConfig = cfg;
+  }
+}
+
+volatile u_int16 *HostPerip (u_int16 addr)
+{
+  SyncChipSelect ();
+  return &perip[addr];
+}
+
+static unsigned char SpiByte (unsigned char out)
+{
+  unsigned char in = 0xff;
+  st.spiBytes++;
+  if (cmdBytes == 0)
+  {
+    opcode = out;
+    address = 0;
+    addrBytes = addr4Mode ? 4 : 3;
+    /* 4-byte address commands work like their 3-byte versions */
+    if (chip->fourByteCommands)
+    {
+      static const unsigned char four[][2] = {
+        {0x13, 0x03}, {0x0c, 0x0b}, {0x12, 0x02},
+        {0x21, 0x20}, {0x5c, 0x52}, {0xdc, 0xd8}};
+      int i;
+      for (i = 0; i < 6; i++)
+      {
+        if (opcode == four[i][0])
+        {
+          opcode = four[i][1];
+          addrBytes = 4;
+        }
+      }
+    }
+    if (ChipBusy () && opcode != 0x05 && opcode != 0x75)
+      st.protocolErrors++;
+    switch (opcode)
+    {
+    case 0x75: /* erase suspend, as listed in SFDP */
+    case 0x7a: /* erase resume */
+      if (chip->bfptDwords < 13 || (chip->bfpt[11] & 0x80000000UL))
+        st.protocolErrors++;
+      else if (opcode == 0x75 && ChipBusy () && busyErasing)
+      {
+        suspendedNs = busyUntilNs - nowNs;
+        StartBusy (SUSPEND_US);
+      }
+      else if (opcode == 0x7a && suspendedNs && !ChipBusy ())
+      {
+        busyUntilNs = nowNs + suspendedNs;
+        busyErasing = 1;
+        suspendedNs = 0;
+      }
+      else
+        st.protocolErrors++;
+      break;
+    case 0x06:
+      if (!ChipBusy ())
+        writeEnable = 1;
+      break;
+    case 0x04:
+      writeEnable = 0;
+      break;
+    case 0xb7:
+      if (chip->bytes > 16L * 1024L * 1024L)
+        addr4Mode = 1;
+      break;
+    case 0x02:
+      memset (pageBufferUsed, 0, sizeof (pageBufferUsed));
+      break;
+    case 0x03:
+    case 0x0b:
+      st.readCommands++;
+      break;
+    }
+    cmdBytes = 1;
+    return in;
+  }
+  switch (opcode)
+  {
+  case 0x05: /* read status register */
+    in = (ChipBusy ()? 0x01 : 0x00) | (writeEnable ? 0x02 : 0x00);
+    if (ChipBusy () && cmdBytes > 1)
+    {
+      /* Polling: skip ahead instead of simulating every poll */
+      st.busyNs += busyUntilNs - nowNs;
+      nowNs = busyUntilNs;
+    }
+    break;
+  case 0x01:
+    statusWrite = out;
+    break;
+  case 0x9f: /* JEDEC ID */
+    if (cmdBytes <= 3)
+      in = (unsigned char) chip->jedecId[cmdBytes - 1];
+    break;
+  case 0x5a: /* SFDP */
+    if (cmdBytes <= 3)
+      address = (address << 8) | out;
+    else if (cmdBytes > 4)
+      in = SfdpByte (address++);
+    break;
+  case 0x02:
+  case 0x03:
+  case 0x0b:
+  case 0x20:
+  case 0x52:
+  case 0xd8:
+    if (cmdBytes <= addrBytes)
+    {
+      address = (address << 8) | out;
+      if (cmdBytes == addrBytes)
+        address %= chip->bytes;
+    }
+    else if (opcode == 0x03 || (opcode == 0x0b && cmdBytes > addrBytes + 1))
+    {
+      in = flash[address];
+      address = (address + 1) % chip->bytes;
+      st.bytesRead++;
+      if (spiClockHz > 1e6 * (opcode == 0x03 ? chip->readMHz
+                              : chip->fastReadMHz))
+      { /* too fast: data is sampled one bit late */
+        in = (in >> 1) | (lastIn << 7);
+      }
+      lastIn = flash[(address + chip->bytes - 1) % chip->bytes];
+    }
+    else if (opcode == 0x02)
+    {
+      /* page program wraps inside the 256-byte page */
+      pageBuffer[address & 255] = out;
+      pageBufferUsed[address & 255] = 1;
+      address = (address & ~255UL) | ((address + 1) & 255);
+    }
+    break;
+  }
+  cmdBytes++;
+  return in;
+}
+
+auto u_int16 SpiSendReceive (register __a0 u_int16 data)
+{
+  u_int16 cfg, bits, div;
+  u_int16 res;
+
+  SyncChipSelect ();
+  cfg = perip[SPI0_CONFIG];
+  bits = ((cfg & SPI_CF_DLEN16) / SPI_CF_DLEN) + 1;
+  div = ((perip[SPI0_CLKCONFIG] / SPI_CC_CLKDIV) & 0xff) + 1;
+  spiClockHz = CORE_CLOCK_HZ / (2 * div);
+  nowNs += SPI_CALL_OVERHEAD_NS +
+    (unsigned long long) (bits * 2 * div * 1e9 / CORE_CLOCK_HZ);
+
+  if (cfg & SPI_CF_FSIDLE1)
+  {
+    return 0xffff; /* xCS high, nobody listens */
+  }
+  if (!csActive)
+  {
+    csActive = 1;
+    cmdBytes = 0;
+  }
+  if (bits > 8)
+  {
+    res = SpiByte (data >> 8) << 8;
+    res |= SpiByte (data & 0xff);
+  }
+  else
+  {
+    res = SpiByte (data & 0xff);
+  }
+  return res;
+}
+
+
+/* host side */
+
+static struct FsMapper *m;
+static u_int32 diskBlocks;  /* from the mapper, the chip is detected */
+static u_int16 shadow[MAX_CHIP_BYTES / 512][256];
+static u_int16 buf[64 * 256];
+static u_int32 seed = 12345;
+static u_int32 blocksWritten;
+static u_int32 blocksRead;
+
+static u_int16 Random (void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return (u_int16) seed;
+}
+
+static unsigned long long stallStartNs;
+
+static void StallStart (void)
+{
+  stallStartNs = nowNs;
+}
+
+static void StallEnd (void)
+{
+  if (nowNs - stallStartNs > st.stallNs)
+    st.stallNs = nowNs - stallStartNs;
+}
+
+/* USB transfer of n blocks, the USB loop runs once per packet */
+static void UsbTransfer (u_int16 n)
+{
+  u_int32 i;
+  for (i = 0; i < n * 8L; i++)
+  {
+    unsigned long long packetEndNs = nowNs + USB_PACKET_NS;
+    StallStart ();
+    FsMapSpiFlashStep ();
+    StallEnd ();
+    if (nowNs < packetEndNs)
+      nowNs = packetEndNs;
+  }
+}
+
+static void HostWriteBlocks (u_int16 lba, const u_int16 *data, u_int16 n)
+{
+  UsbTransfer (n);
+  memcpy (buf, data, n * 512);
+  StallStart ();
+  if (m->Write (m, lba, n, buf) != n)
+  {
+    printf ("write of block %u rejected\n", lba);
+    exit (EXIT_FAILURE);
+  }
+  StallEnd ();
+  memcpy (shadow[lba], data, n * 512);
+  blocksWritten += n;
+}
+
+static void HostWrite (u_int16 lba, const u_int16 *data)
+{
+  HostWriteBlocks (lba, data, 1);
+}
+
+static void WriteRandom (u_int16 lba)
+{
+  u_int16 tmp[256];
+  int i;
+  for (i = 0; i < 256; i++)
+    tmp[i] = Random ();
+  HostWrite (lba, tmp);
+}
+
+/* One WRITE(10) of n blocks of data, or of random blocks if data is
+   NULL, handed to the mapper block by block with the SCSI state the ROM
+   keeps during the data stage */
+static void WriteCommandOf (u_int16 lba, u_int16 n, const u_int16 *data)
+{
+  u_int16 i;
+  SCSI.State = SCSI_DATA_FROM_HOST;
+  for (i = 0; i < n; i++)
+  {
+    SCSI.CurrentDiskSector = lba + i;
+    SCSI.BlocksLeftToReceive = n - i;
+    if (data)
+      HostWrite (lba + i, data + 256 * i);
+    else
+      WriteRandom (lba + i);
+  }
+  SCSI.State = SCSI_READY_FOR_COMMAND;
+  SCSI.BlocksLeftToReceive = 0;
+}
+
+static void WriteCommand (u_int16 lba, u_int16 n)
+{
+  WriteCommandOf (lba, n, NULL);
+}
+
+static void Detach (void)
+{
+  m->Flush (m, 1);
+  SyncChipSelect ();
+}
+
+static int Verify (void)
+{
+  u_int32 lba;
+  int bad = 0;
+  struct SimStats saved = st;
+  unsigned long long savedNs = nowNs;
+
+  for (lba = 0; lba < diskBlocks; lba++)
+  {
+    u_int16 i;
+    const unsigned char *p = flash + (u_int32) (lba + RESERVED_BLOCKS) * 512;
+    if (m->Read (m, lba, 1, buf) != 1 || memcmp (buf, shadow[lba], 512))
+      bad++;
+    /* check the raw image as well, data must not be left in the cache */
+    for (i = 0; i < 256; i++)
+    {
+      u_int16 w = (p[2 * i] << 8) | p[2 * i + 1];
+#if USE_INVERTED_DISK_DATA
+      w = ~w;
+#endif
+      if (w != shadow[lba][i])
+      {
+        bad++;
+        break;
+      }
+    }
+  }
+  /* nothing may touch the boot code before the disk */
+  if (memcmp (flash, bootImage, sizeof (bootImage)))
+    bad++;
+  st = saved;
+  nowNs = savedNs;
+  return bad;
+}
+
+static void ResetStats (void)
+{
+  memset (&st, 0, sizeof (st));
+  memset (sectorErases, 0, sizeof (sectorErases));
+  nowNs = busyUntilNs = 0;
+  blocksWritten = blocksRead = 0;
+}
+
+static void Report (const char *name)
+{
+  double seconds = nowNs / 1e9;
+  double mb = (blocksWritten ? blocksWritten : blocksRead) / 2048.0;
+  u_int16 i, hottest = 0;
+  int bad;
+
+  for (i = 0; i < chip->bytes / 4096; i++)
+  {
+    if (sectorErases[i] > sectorErases[hottest])
+      hottest = i;
+  }
+  bad = Verify ();
+  printf ("%-10s %6lu %6lu %6lu %7lu %8llu %5u@%-3u %8.3f %8.2f %6.1f %4lu %s\n",
+          name, (unsigned long) (blocksWritten + blocksRead),
+          (unsigned long) (st.erase4K + st.erase32K + st.erase64K),
+          (unsigned long) st.pagePrograms, (unsigned long) st.statusWrites,
+          st.bytesRead, sectorErases[hottest], hottest, seconds,
+          mb > 0 ? seconds / mb : 0.0, st.stallNs / 1e6,
+          (unsigned long) st.protocolErrors,
+          bad ? "MISMATCH" : "ok");
+  if (bad)
+    exit (EXIT_FAILURE);
+}
+
+/* The FAT and root directory live in the first sectors of the disk */
+static void PrintFirstSectors (void)
+{
+  u_int16 i;
+  printf ("  erases of first disk sectors:");
+  for (i = RESERVED_BLOCKS / 8; i < RESERVED_BLOCKS / 8 + 4; i++)
+    printf (" %u", sectorErases[i]);
+  printf ("\n");
+}
+
+
+/* workloads */
+
+/* Large file copy: 64 KB write commands */
+static void SequentialWrite (void)
+{
+  u_int32 lba;
+  for (lba = 0; lba < diskBlocks; lba += 128)
+    WriteCommand (lba, diskBlocks - lba < 128 ? diskBlocks - lba : 128);
+  Detach ();
+}
+
+/* One READ(10) of n blocks: the ROM reads a block, then sends it while
+   the USB loop runs, with the SCSI state it keeps during the data stage */
+static void ReadCommand (u_int32 lba, u_int16 n)
+{
+  u_int16 i;
+  SCSI.State = SCSI_DATA_TO_HOST;
+  for (i = 0; i < n; i++)
+  {
+    SCSI.CurrentDiskSector = lba + i;
+    SCSI.BlocksLeftToSend = n - i;
+    StallStart ();
+    if (m->Read (m, lba + i, 1, buf) != 1
+        || memcmp (buf, shadow[lba + i], 512))
+    {
+      printf ("read of block %lu returned wrong data\n",
+              (unsigned long) (lba + i));
+      exit (EXIT_FAILURE);
+    }
+    StallEnd ();
+    SCSI.BlocksLeftToSend = n - i - 1;
+    UsbTransfer (1);
+    blocksRead++;
+  }
+  SCSI.State = SCSI_READY_FOR_COMMAND;
+}
+
+/* Host verifies the disk: 64 KB read commands */
+static void SequentialRead (void)
+{
+  u_int32 lba;
+  for (lba = 0; lba < diskBlocks; lba += 128)
+    ReadCommand (lba, diskBlocks - lba < 128 ? diskBlocks - lba : 128);
+}
+
+/* Host reads a file, changes a block of it and reads it again */
+static void ReadModifyRead (void)
+{
+  int n;
+  for (n = 0; n < 64; n++)
+  {
+    u_int32 lba = Random () % (diskBlocks - 16);
+    ReadCommand (lba, 16);
+    WriteRandom (lba + Random () % 16);
+    ReadCommand (lba, 16);
+  }
+  Detach ();
+}
+
+/* Host writes data and reads it back at once, before anything has been
+   flushed: random data, then a blank 4K sector that the mapper erases in
+   the background, in one WRITE(10). Then blank 64K blocks of the chip
+   in one WRITE(10) each, which the mapper erases with one command. Last
+   a blank 4K sector on its own, read back, and its old data written
+   again: the checksums of what the flash holds must not be those of
+   the old data while the sector is blank. */
+static void WriteReadBack (void)
+{
+  int n;
+  u_int16 i, tmp[16 * 256];
+  static u_int16 blank[128 * 256];
+#if !USE_INVERTED_DISK_DATA
+  memset (blank, 0xff, sizeof (blank));
+#endif
+  for (n = 0; n < 32; n++)
+  {
+    u_int32 lba = (Random () % (diskBlocks / 8 - 2)) * 8;
+    for (i = 0; i < 8 * 256; i++)
+      tmp[i] = Random ();
+    memcpy (tmp + 8 * 256, blank, 8 * 512);
+    WriteCommandOf (lba, 16, tmp);
+    ReadCommand (lba + 8, 8);
+    ReadCommand (lba, 16);
+  }
+  for (n = 0; n < 4; n++)
+  {
+    u_int32 blocks64K = (diskBlocks + RESERVED_BLOCKS) / 128;
+    u_int32 lba = (1 + Random () % (blocks64K - 1)) * 128 - RESERVED_BLOCKS;
+    WriteCommand (lba, 128);
+    Detach ();
+    WriteCommandOf (lba, 128, blank);
+    ReadCommand (lba + 120, 8);
+  }
+  for (n = 0; n < 32; n++)
+  {
+    u_int32 lba = (Random () % (diskBlocks / 8)) * 8;
+    memcpy (tmp, shadow[lba], 8 * 512);
+    WriteCommandOf (lba, 8, blank);
+    ReadCommand (lba, 8);
+    WriteCommandOf (lba, 8, tmp);
+    ReadCommand (lba, 8);
+  }
+  Detach ();
+}
+
+/* Playback through ReadDiskSector(), one block at a time, no USB */
+static void Playback (void)
+{
+  u_int32 lba;
+  usbBuffersInUse = 0; /* as after USB detach */
+  for (lba = 0; lba < diskBlocks; lba++)
+  {
+    m->Read (m, lba, 1, buf);
+    blocksRead++;
+  }
+}
+
+static void Random4K (void)
+{
+  int n;
+  for (n = 0; n < 64; n++)
+  {
+    u_int32 lba = (Random () % (diskBlocks / 8)) * 8, k;
+    for (k = 0; k < 8; k++)
+      WriteRandom (lba + k);
+  }
+  Detach ();
+}
+
+/* Whole 4K sectors, blocks arriving out of order */
+static void Shuffled4K (void)
+{
+  u_int32 lba, k;
+  for (lba = 0; lba + 8 <= diskBlocks; lba += 8)
+  {
+    for (k = 0; k < 8; k++)
+      WriteRandom (lba + ((k * 5 + 3) & 7));
+  }
+  Detach ();
+}
+
+static void Random512 (void)
+{
+  int n;
+  for (n = 0; n < 256; n++)
+    WriteRandom (Random () % diskBlocks);
+  Detach ();
+}
+
+/* Host writes back data it has just changed */
+static void Revert (void)
+{
+  int n;
+  u_int16 tmp[256];
+  for (n = 0; n < 64; n++)
+  {
+    u_int32 lba = Random () % diskBlocks;
+    memcpy (tmp, shadow[lba], sizeof (tmp));
+    WriteRandom (lba);
+    HostWrite (lba, tmp);
+  }
+  Detach ();
+}
+
+/*
+   USB bus reset while the cache is written back, right after a sector
+   erase. The host must read back what it wrote while the flush is
+   pending, then the USB loop finishes the flush.
+*/
+static void ResetDuringFlush (void)
+{
+  int n, bad = 0;
+  u_int32 lba;
+  for (n = 0; n < 12; n++)
+    WriteRandom (Random () % diskBlocks);
+  resetOnErase = 1;
+  m->Flush (m, 1);
+  if (!shouldFlush)
+  {
+    printf ("bus reset did not interrupt the flush\n");
+    exit (EXIT_FAILURE);
+  }
+  for (lba = 0; lba < diskBlocks; lba++)
+  {
+    if (m->Read (m, lba, 1, buf) != 1 || memcmp (buf, shadow[lba], 512))
+      bad++;
+  }
+  if (bad)
+  {
+    printf ("%d blocks read wrong while the flush was pending\n", bad);
+    exit (EXIT_FAILURE);
+  }
+  m->Flush (m, 1); /* as the USB loop does when shouldFlush is set */
+  Detach ();
+}
+
+/* Format or delete: zeros in 32 KB write commands */
+static void ZeroFill (void)
+{
+  u_int32 lba;
+  static const u_int16 zero[64 * 256];
+  for (lba = 0; lba < diskBlocks; lba += 64)
+  {
+    WriteCommandOf (lba, diskBlocks - lba < 64 ? diskBlocks - lba : 64,
+                    zero);
+  }
+  Detach ();
+}
+
+/*
+   A FAT12 file copy as Windows does it: directory entry, data clusters,
+   both FAT copies, then the directory entry again with the file size.
+   One 512-byte sector per cluster.
+*/
+#define FAT1_LBA 1
+#define FAT_BLOCKS 3
+#define ROOT_LBA (FAT1_LBA + 2 * FAT_BLOCKS)
+#define ROOT_BLOCKS 8
+#define DATA_LBA (ROOT_LBA + ROOT_BLOCKS)
+
+static unsigned char fat[FAT_BLOCKS * 512];
+static unsigned char root[ROOT_BLOCKS * 512];
+
+static void PackBytes (u_int16 *d, const unsigned char *s)
+{
+  int i;
+  for (i = 0; i < 256; i++)
+    d[i] = (s[2 * i] << 8) | s[2 * i + 1];
+}
+
+static void SetFat12 (u_int16 cluster, u_int16 value)
+{
+  u_int16 off = cluster + cluster / 2;
+  if (cluster & 1)
+  {
+    fat[off] = (fat[off] & 0x0f) | (value << 4);
+    fat[off + 1] = value >> 4;
+  }
+  else
+  {
+    fat[off] = value;
+    fat[off + 1] = (fat[off + 1] & 0xf0) | ((value >> 8) & 0x0f);
+  }
+}
+
+static void WriteFatAndDir (u_int16 dirBlock)
+{
+  u_int16 tmp[256];
+  u_int16 i, copy;
+  for (copy = 0; copy < 2; copy++)
+  {
+    for (i = 0; i < FAT_BLOCKS; i++)
+    {
+      PackBytes (tmp, fat + 512 * i);
+      HostWrite (FAT1_LBA + copy * FAT_BLOCKS + i, tmp);
+    }
+  }
+  PackBytes (tmp, root + 512 * dirBlock);
+  HostWrite (ROOT_LBA + dirBlock, tmp);
+}
+
+static void QuickFormat (void)
+{
+  u_int16 tmp[256];
+  u_int32 lba;
+  /* boot sector with the BPB of the layout above */
+  memset (root, 0, sizeof (root));
+  memset (fat, 0, sizeof (fat));
+  fat[11] = 0x00; fat[12] = 0x02; /* bytes per sector */
+  fat[13] = 1;  /* sectors per cluster */
+  fat[14] = FAT1_LBA; /* reserved sectors */
+  fat[16] = 2;  /* FATs */
+  fat[17] = ROOT_BLOCKS * 16; /* root entries */
+  fat[22] = FAT_BLOCKS; /* sectors per FAT */
+  fat[510] = 0x55;
+  fat[511] = 0xaa;
+  PackBytes (tmp, fat);
+  HostWrite (0, tmp);
+  memset (fat, 0, sizeof (fat));
+  fat[0] = 0xf8;
+  fat[1] = fat[2] = 0xff;
+  for (lba = 0; lba < ROOT_BLOCKS; lba++)
+  {
+    PackBytes (tmp, root + 512 * lba);
+    HostWrite (ROOT_LBA + lba, tmp);
+  }
+  WriteFatAndDir (0);
+  Detach ();
+}
+
+/* New write time and access date, any bits may change */
+static void StampDirEntry (unsigned char *e)
+{
+  u_int16 i;
+  for (i = 18; i < 26; i++)
+  {
+    if (i < 20 || i >= 22)
+      e[i] = (unsigned char) Random ();
+  }
+}
+
+static void CopyFiles (u_int16 clustersPerFile)
+{
+  u_int16 file, cluster = 2;
+
+  for (file = 0; cluster + clustersPerFile < diskBlocks - DATA_LBA
+       && cluster + clustersPerFile < FAT_BLOCKS * 512 * 2 / 3
+       && file < ROOT_BLOCKS * 16; file++)
+  {
+    unsigned char *e = root + 32 * file;
+    u_int16 dirBlock = file / 16, c;
+    u_int32 size = clustersPerFile * 512L;
+
+    memcpy (e, "SOUND   WAV", 11);
+    e[7] = '0' + file % 10;
+    e[11] = 0x20;
+    e[26] = cluster & 0xff;
+    e[27] = cluster >> 8;
+    StampDirEntry (e);
+    WriteFatAndDir (dirBlock);
+    WriteCommand (DATA_LBA + cluster - 2, clustersPerFile);
+    for (c = 0; c < clustersPerFile; c++)
+    {
+      SetFat12 (cluster + c, c == clustersPerFile - 1 ? 0xfff : cluster + c + 1);
+    }
+    e[28] = size & 0xff;
+    e[29] = (size >> 8) & 0xff;
+    e[30] = (size >> 16) & 0xff;
+    StampDirEntry (e);
+    WriteFatAndDir (dirBlock);
+    cluster += clustersPerFile;
+  }
+  Detach ();
+}
+
+#if USE_PRE_ERASE
+/* Longest time a file open waited for its first read, see Trigger() */
+static unsigned long long triggerNs;
+
+/* A GPIO trigger while the player pre-erases: the first read of the
+   file open, after FsMapSpiFlashPreEraseSuspend() as in spiusb.c */
+static void Trigger (void)
+{
+  unsigned long long startNs = nowNs;
+  FsMapSpiFlashPreEraseSuspend ();
+  if (m->Read (m, FAT1_LBA, 1, buf) != 1
+      || memcmp (buf, shadow[FAT1_LBA], 512))
+  {
+    printf ("file open read wrong data during pre-erase\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nowNs - startNs > triggerNs)
+    triggerNs = nowNs - startNs;
+}
+
+/* Let the mapper erase the free sectors between audio buffers, with a
+   trigger now and then */
+static void PreEraseWhileSilent (void)
+{
+  u_int32 n;
+  for (n = 0; FsMapSpiFlashPreErase (); n++)
+  {
+    nowNs += 100000;
+    if (n % 16 == 5)
+      Trigger ();
+  }
+  SyncChipSelect ();
+}
+#endif
+
+/* Delete all files, then free the data area as the FAT walk after USB
+   detach does and let the mapper erase it between audio buffers */
+static void TrimAndPreErase (void)
+{
+  FsMapSpiFlashForgetFree ();
+  m->Free (m, DATA_LBA, diskBlocks - DATA_LBA);
+  FsMapSpiFlashFreeDone ();
+#if USE_PRE_ERASE
+  {
+    u_int32 lba, first = (DATA_LBA + RESERVED_BLOCKS + 7) & ~7L;
+    for (lba = DATA_LBA; lba < diskBlocks; lba++)
+    {
+      u_int32 sector = (lba + RESERVED_BLOCKS) & ~7L;
+      if (sector >= first && sector + 8 <= diskBlocks + RESERVED_BLOCKS)
+      {
+#if USE_INVERTED_DISK_DATA
+        memset (shadow[lba], 0, 512);
+#else
+        memset (shadow[lba], 0xff, 512);
+#endif
+      }
+    }
+  }
+  PreEraseWhileSilent ();
+#endif
+}
+
+/* Free a written area, then have the host write it again with the same
+   data and change one block per 4K. The sectors are in use again, so
+   neither the write-back nor a later pre-erase may lose the blocks the
+   host did not change. */
+static void FreeAndRewrite (void)
+{
+  u_int32 lba, first = 64, n = 64;
+  u_int16 tmp[256];
+  for (lba = first; lba < first + n; lba++)
+    WriteRandom (lba);
+  Detach ();
+  m->Free (m, first, n);
+  FsMapSpiFlashFreeDone ();
+  for (lba = first; lba < first + n; lba++)
+  {
+    memcpy (tmp, shadow[lba], sizeof (tmp));
+    HostWrite (lba, tmp);
+  }
+  for (lba = first + 3; lba < first + n; lba += 8)
+    WriteRandom (lba);
+  Detach ();
+#if USE_PRE_ERASE
+  PreEraseWhileSilent ();
+#endif
+}
+
+
+int main (int argc, char **argv)
+{
+  u_int16 i;
+
+  chip = &profiles[0];
+  for (i = 0; i < sizeof (profiles) / sizeof (profiles[0]); i++)
+  {
+    if (argc > 1 && !strcmp (argv[1], profiles[i].name))
+      chip = &profiles[i];
+  }
+  memset (flash, 0xff, sizeof (flash));
+  /* boot code in the reserved blocks */
+  for (i = 0; i < RESERVED_BLOCKS * 512 / 2; i++)
+  {
+    u_int16 w = Random ();
+    flash[2 * i] = w >> 8;
+    flash[2 * i + 1] = w;
+  }
+  memcpy (bootImage, flash, sizeof (bootImage));
+  perip[SPI0_CONFIG] = SPI_CF_FSIDLE1;
+  m = FsMapSpiFlashCreate (NULL, 0);
+  FsMapSpiFlashCalibrate (1); /* as on USB attach */
+  diskBlocks = m->blocks;
+  /* a blank chip reads as all zero logical data */
+  for (i = 0; i < diskBlocks; i++)
+  {
+#if USE_INVERTED_DISK_DATA
+    memset (shadow[i], 0, 512);
+#else
+    memset (shadow[i], 0xff, 512);
+#endif
+  }
+
+  printf ("chip %s, %lu logical blocks, read command 0x%02x, SPI divider %u\n",
+          chip->name, (unsigned long) diskBlocks, spiReadCommand,
+          spiClockDivider);
+  printf ("read 0x%02x program 0x%02x erase 4K 0x%02x 32K 0x%02x 64K 0x%02x "
+          "suspend 0x%02x, %u-byte addresses%s\n", readCommand,
+          programCommand, erase4KCommand, erase32KCommand, erase64KCommand,
+          eraseSuspendCommand, use4ByteAddress ? 4 : 3,
+          addr4Mode ? " (B7h mode)" : "");
+  printf ("%-10s %6s %6s %6s %7s %8s %9s %8s %8s %6s %4s\n", "workload",
+          "blocks", "erases", "pages", "wrsr", "rdbytes", "hot@sect",
+          "seconds", "s/MB", "stall", "perr");
+
+  ResetStats ();
+  SequentialWrite ();
+  Report ("seq-blank");
+
+  ResetStats ();
+  SequentialWrite ();
+  Report ("seq-over");
+
+  ResetStats ();
+  SequentialRead ();
+  Report ("seq-read");
+
+  ResetStats ();
+  ReadModifyRead ();
+  Report ("read-mod");
+
+  ResetStats ();
+  WriteReadBack ();
+  Report ("write-read");
+
+  ResetStats ();
+  Playback ();
+  Report ("playback");
+  FsMapSpiFlashCalibrate (1); /* USB attach again */
+
+  ResetStats ();
+  Random4K ();
+  Report ("rand-4k");
+
+  ResetStats ();
+  Shuffled4K ();
+  Report ("shuffle");
+
+  ResetStats ();
+  Random512 ();
+  Report ("rand-512");
+
+  ResetStats ();
+  Revert ();
+  Report ("revert");
+
+  ResetStats ();
+  ResetDuringFlush ();
+  Report ("bus-reset");
+
+  ResetStats ();
+  FreeAndRewrite ();
+  Report ("free-rewr");
+
+  QuickFormat ();
+  ResetStats ();
+  CopyFiles (48);
+  Report ("copy-fat");
+  PrintFirstSectors ();
+
+  QuickFormat ();
+  ResetStats ();
+  CopyFiles (3);
+  Report ("copy-small");
+  PrintFirstSectors ();
+
+  QuickFormat ();
+  ResetStats ();
+  TrimAndPreErase ();
+  Report ("pre-erase");
+#if USE_PRE_ERASE
+  printf ("  longest trigger wait for the flash: %.3f ms\n", triggerNs / 1e6);
+#endif
+  ResetStats ();
+  CopyFiles (48);
+  Report ("copy-trim");
+  PrintFirstSectors ();
+
+  ResetStats ();
+  ZeroFill ();
+  Report ("zero-fill");
+
+  return EXIT_SUCCESS;
+}
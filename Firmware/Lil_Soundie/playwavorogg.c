@@ -25,10 +25,164 @@ extern struct CodecServices cs;
 
 #ifdef GAPLESS
 struct Codec *CodVorbisCreate (void);
+extern struct Codec codecVorbis; /* starts with the generic Codec */
 extern u_int16 ogg[];
 //extern struct CodVOgg ogg;
 extern s_int16 vFirstFrame;
 auto s_int16 OggSeekHeader (register u_int32 pos);
+
+/* Key of the Vorbis setup that the decoder holds, valid while
+   vorbisSetupKnown is set. See VorbisSetupKey(). */
+u_int16 vorbisSetupKey[2];
+u_int16 vorbisSetupKnown;
+
+void VorbisSetupForget (void);
+
+// Fletcher sums of the identification and setup headers of the open
+// Ogg Vorbis file to key. The comment header is left out: it differs
+// between files encoded with the same settings, so the headers may also
+// end at a different offset in each file. Returns the offset of the
+// first audio page, or 0 if the headers are not understood.
+u_int32 VorbisSetupKey (u_int16 * key)
+{
+  u_int32 page = 0, data;
+  register u_int16 packet = 0, a = 0, b = 0;
+
+  while (packet < 3)
+  {
+    u_int16 h[14], segments, s;
+
+    Seek (page);
+    ReadFile (h, 0, 27);
+    if (h[0] != 0x4f67 || h[1] != 0x6753 || page > 0x20000UL)
+    { /* not 'OggS', or headers longer than any sane setup */
+      return 0;
+    }
+    segments = h[13] >> 8;
+    data = page + 27 + segments;
+    for (s = 0; s < segments; s++)
+    {
+      u_int16 lace = 0;
+
+      if (packet == 3)
+      { /* audio in the page of the setup header */
+        return 0;
+      }
+      Seek (page + 27 + s);
+      ReadFile (&lace, 1, 1);
+      if (packet != 1)
+      {
+        register u_int16 n = lace;
+        a += lace;
+        b += a;
+        Seek (data);
+        while (n)
+        {
+          register u_int16 i, c = n > 128 ? 128 : n;
+          ReadFile ((u_int16 *) tmpBuf, 0, c);
+          if (c & 1)
+          {
+            tmpBuf[c >> 1] &= 0xff00;
+          }
+          for (i = 0; i < (c + 1) >> 1; i++)
+          {
+            a += tmpBuf[i];
+            b += a;
+          }
+          n -= c;
+        }
+      }
+      data += lace;
+      if (lace < 255)
+      {
+        packet++;
+      }
+    }
+    page = data;
+  }
+  key[0] = a;
+  key[1] = b;
+  return page;
+}
+
+// If the open file has the same Vorbis setup as the one the decoder
+// holds, start decoding its audio without rebuilding the codebooks and
+// other tables from the headers. Returns ceFormatNotFound otherwise.
+enum CodecError PlayKnownVorbisSetup (void)
+{
+  u_int16 key[2];
+  u_int32 audioBegins;
+
+  if (!vorbisSetupKnown)
+  {
+    // putch('n');
+    return ceFormatNotFound;
+  }
+  audioBegins = VorbisSetupKey (key);
+  if (!audioBegins || key[0] != vorbisSetupKey[0]
+      || key[1] != vorbisSetupKey[1])
+  {
+    /* a file with different parameters (or WAV) */
+    // putch('-');
+    Seek (0);
+    return ceFormatNotFound;
+  }
+  {
+    /* the same setup, skip Vorbis decoder init. */
+    const char *eStr;
+    register enum CodecError ret;
+    OggSeekHeader (audioBegins);
+    ogg[1] /* .headerTypeFlag */  = 0;
+    ogg[6] /* .streamSerialNumber */  = 0;
+    ogg[7] /* .streamSerialNumber */  = 0;
+    ogg[14] /* .cont */  = 0;
+    // ogg.headerTypeFlag = 0;
+    // ogg.cont = 0;
+    vFirstFrame = 1;
+    cs.playTimeSeconds = 0;
+    cs.playTimeSamples = 0;
+    // putch('+');
+#ifdef HAS_PATCHCODVORBISDECODE
+    /* available in latest dev1000.h */
+    ret = PatchCodVorbisDecode (&codecVorbis, &cs, &eStr, 0);
+#else
+    /* TODO: call Decode() with silentchannelpatches */
+    ret = CodVorbisDecode (&codecVorbis, &cs, &eStr);
+#endif
+    if (ret != ceOk && ret != ceCancelled)
+    {
+      VorbisSetupForget ();
+    }
+    return ret;
+  }
+}
+
+// Decode the open file from its headers, and remember the key of the
+// setup it leaves in the decoder if it was played through. A file that
+// fails or is cancelled may have left the setup half built.
+enum CodecError PlayNewVorbisSetup (void)
+{
+  register enum CodecError ret;
+  u_int16 key[2];
+  register u_int32 audioBegins = VorbisSetupKey (key);
+
+  VorbisSetupForget (); /* the decoder rebuilds it from the headers */
+  Seek (0);
+  ret = PatchPlayCurrentFile ();
+  if (ret == ceOk && audioBegins)
+  {
+    vorbisSetupKey[0] = key[0];
+    vorbisSetupKey[1] = key[1];
+    vorbisSetupKnown = 1;
+  }
+  return ret;
+}
+
+// The decoder memory is about to be used for something else
+void VorbisSetupForget (void)
+{
+  vorbisSetupKnown = 0;
+}
 #endif /*GAPLESS*/
 #ifdef USE_WAV
 #include <codecmicrowav.h>
@@ -38,49 +192,166 @@ auto s_int16 OggSeekHeader (register u_int32 pos);
 //extern u_int16 mInt[];
 extern struct CodecServices cs;
 extern struct Codec *cod;
-enum CodecError PlayWavOrOggFile (void)
+
+#if USE_WAV_LOOP
+/* RIFF chunk ids as read little-endian, low word first */
+#define ID_LO(a,b) ((a) | ((b) << 8))
+#define WAV_DATA_BLOCK 64 /* words, the size of tmpBuf */
+
+// Play a linear PCM WAV file, 8 or 16 bits, mono or stereo. When it
+// reaches the end of the loop and the same file is still selected, it
+// seeks back to the loop start instead of returning, so that the main
+// loop does not reopen the file and the audio does not break. The loop
+// is the first loop of a smpl chunk, or else all of the data. Returns
+// ceCancelled when USB is attached, so that the main loop can go to
+// mass storage mode.
+enum CodecError PlayLoopingWav (void)
 {
-  register enum CodecError ret = ceFormatNotFound;
-  const char *eStr;
-  LoadCheck (NULL, 0);  /* higher clock, but 4.0x not absolutely required */
+  u_int16 h[18];
+  u_int32 dataStart = 0, dataEnd = 0, loopStart = 0, loopEnd = 0;
+  u_int32 pos, chunkSize;
+  u_int16 format = 0, bits = 0, frameBytes = 0;
+  s_int16 file = player.currentFile;
 
-#ifdef GAPLESS
-  if (codecVorbis.audioBegins)
+  ReadFile (h, 0, -12);
+  if (h[0] != ID_LO ('R', 'I') || h[1] != ID_LO ('F', 'F')
+      || h[4] != ID_LO ('W', 'A') || h[5] != ID_LO ('V', 'E'))
+  {
+    return ceFormatNotFound;
+  }
+  // Walk the chunks, the smpl chunk may be after the data
+  pos = 12;
+  while (pos + 8 <= minifatInfo.fileSize)
+  {
+    Seek (pos);
+    ReadFile (h, 0, -8);
+    chunkSize = ((u_int32) h[3] << 16) | h[2];
+    pos += 8;
+    if (chunkSize > minifatInfo.fileSize - pos)
+    { // cut short, or a size no sane file has: the chunk ends with the file
+      chunkSize = minifatInfo.fileSize - pos;
+    }
+    if (h[0] == ID_LO ('f', 'm') && h[1] == ID_LO ('t', ' '))
+    {
+      ReadFile (h, 0, -16);
+      format = h[0];
+      cs.channels = h[1];
+      cs.sampleRate = ((u_int32) h[3] << 16) | h[2];
+      frameBytes = h[6];
+      bits = h[7];
+    }
+    else if (h[0] == ID_LO ('d', 'a') && h[1] == ID_LO ('t', 'a'))
+    {
+      dataStart = pos;
+      dataEnd = pos + chunkSize;
+    }
+    else if (h[0] == ID_LO ('s', 'm') && h[1] == ID_LO ('p', 'l')
+             && chunkSize >= 36 + 24)
+    {
+      ReadFile (h, 0, -36);
+      if (h[14] | h[15])  /* number of loops */
+      {
+        ReadFile (h, 0, -24);
+        loopStart = ((u_int32) h[5] << 16) | h[4];
+        loopEnd = (((u_int32) h[7] << 16) | h[6]) + 1;  /* inclusive */
+      }
+    }
+    pos += chunkSize + (chunkSize & 1);
+  }
+  if (format != 1 || !dataStart || (bits != 8 && bits != 16)
+      || cs.channels < 1 || cs.channels > 2 || !cs.sampleRate
+      || frameBytes != cs.channels * (bits >> 3))
   {
-    u_int16 data[2];
-    Seek (codecVorbis.audioBegins);
-    ReadFile (data, 0, 4);
-    if (data[0] == 0x4f67 && data[1] == 0x6753)
+    return ceFormatNotFound;
+  }
+  dataEnd -= (dataEnd - dataStart) % frameBytes;
+  // smpl loop points are in sample frames from the start of the data
+  if (loopEnd <= loopStart || loopEnd > (dataEnd - dataStart) / frameBytes)
+  {
+    loopStart = 0;
+    loopEnd = (dataEnd - dataStart) / frameBytes;
+  }
+  loopStart = dataStart + loopStart * frameBytes;
+  loopEnd = dataStart + loopEnd * frameBytes;
+
+  cs.playTimeSeconds = 0;
+  cs.playTimeSamples = 0;
+  cs.playTimeTotal = (dataEnd - dataStart) / frameBytes / cs.sampleRate;
+  pos = dataStart;
+  Seek (pos);
+  while (1)
+  {
+    register u_int16 bytes, frames;
+    u_int32 end;
+
+    if (cs.cancel || USBIsAttached ())
     {
-      /* 'OggS', assume the same parameters, skip Vorbis decoder init. */
-      const char *eStr;
-      register s_int16 res = OggSeekHeader (codecVorbis.audioBegins);
-      ogg[1] /* .headerTypeFlag */  = 0;
-      ogg[6] /* .streamSerialNumber */  = 0;
-      ogg[7] /* .streamSerialNumber */  = 0;
-      ogg[14] /* .cont */  = 0;
-      // ogg.headerTypeFlag = 0;
-      // ogg.cont = 0;
-      vFirstFrame = 1;
-      cs.playTimeSeconds = 0;
-      cs.playTimeSamples = 0;
-      // putch('+');
-#ifdef HAS_PATCHCODVORBISDECODE
-      /* available in latest dev1000.h */
-      return PatchCodVorbisDecode (&codecVorbis, &cs, &eStr, 0);
-#else
-      /* TODO: call Decode() with silentchannelpatches */
-      return CodVorbisDecode (&codecVorbis, &cs, &eStr);
-#endif
+      cs.cancel = 0;
+      return ceCancelled;
+    }
+    if (pos == loopEnd && player.currentFile == file)
+    { // still selected: go round again, else play on to the end
+      pos = loopStart;
+      Seek (pos);
+    }
+    if (pos >= dataEnd)
+    {
+      return ceOk;
+    }
+    end = pos < loopEnd ? loopEnd : dataEnd;
+    bytes = (bits == 16 ? 2 : 1) * WAV_DATA_BLOCK;
+    if (end - pos < bytes)
+    {
+      bytes = end - pos;
+    }
+    frames = bytes / frameBytes;
+    if (bits == 16)
+    {
+      ReadFile ((u_int16 *) tmpBuf, 0, -bytes);
     }
     else
+    { // unsigned bytes to the top half of the words, in place
+      register u_int16 i;
+      register u_int16 *p = (u_int16 *) tmpBuf + WAV_DATA_BLOCK / 2;
+      ReadFile (p, 0, -bytes);
+      for (i = 0; i < bytes; i++)
+      {
+        tmpBuf[i] = (((p[i >> 1] >> ((i & 1) << 3)) & 0xff) ^ 0x80) << 8;
+      }
+    }
+    pos += bytes;
+    cs.playTimeSamples += frames;
+    if (cs.playTimeSamples >= cs.sampleRate)
     {
-      /* 'OggS' Not found, must be a file with different parameters (or WAV) */
-      // putch('-');
-      Seek (0);
+      cs.playTimeSamples -= cs.sampleRate;
+      cs.playTimeSeconds++;
     }
+    cs.Output (&cs, tmpBuf, frames);
+  }
+}
+#endif /* USE_WAV_LOOP */
+
+enum CodecError PlayWavOrOggFile (void)
+{
+  register enum CodecError ret = ceFormatNotFound;
+  const char *eStr;
+  LoadCheck (NULL, 0);  /* higher clock, but 4.0x not absolutely required */
+
+#ifdef GAPLESS
+  ret = PlayKnownVorbisSetup ();
+  if (ret != ceFormatNotFound)
+  {
+    return ret;
   }
 #endif /*GAPLESS*/
+#if USE_WAV_LOOP
+  ret = PlayLoopingWav ();  /* only uses tmpBuf, keeps the Vorbis setup */
+  if (ret != ceFormatNotFound)
+  {
+    return ret;
+  }
+  Seek (0);
+#endif /* USE_WAV_LOOP */
     if ((cod = CodMicroWavCreate ()))
   {
     ret = cod->Decode (cod, &cs, &eStr);
@@ -101,55 +372,29 @@ enum CodecError PlayWavOrOggFile (void)
     if (ret != ceFormatNotFound)
     {
 #ifdef GAPLESS
-      codecVorbis.audioBegins = 0;
+      VorbisSetupForget ();
 #endif
       return ret;
     }
     /* If failed, seek to the beginning and try Ogg Vorbis decoding. */
     cs.Seek (&cs, 0, SEEK_SET);
   }
+#ifdef GAPLESS
+  return PlayNewVorbisSetup ();
+#else
   return PatchPlayCurrentFile ();
+#endif
 }
 #else /* USE_WAV */
 #ifdef GAPLESS
 enum CodecError PlayGaplessOggFile (void)
 {
-  if (codecVorbis.audioBegins)
+  register enum CodecError ret = PlayKnownVorbisSetup ();
+  if (ret != ceFormatNotFound)
   {
-    u_int16 data[2];
-
-    Seek (codecVorbis.audioBegins);
-    ReadFile (data, 0, 4);
-    if (data[0] == 0x4f67 && data[1] == 0x6753)
-    {
-      /* 'OggS', assume the same parameters, skip Vorbis decoder init. */
-      const char *eStr;
-      register s_int16 res = OggSeekHeader (codecVorbis.audioBegins);
-      ogg[1] /* .headerTypeFlag */  = 0;
-      ogg[6] /* .streamSerialNumber */  = 0;
-      ogg[7] /* .streamSerialNumber */  = 0;
-      ogg[14] /* .cont */  = 0;
-      // ogg.headerTypeFlag = 0;
-      // ogg.cont = 0;
-      vFirstFrame = 1;
-      cs.playTimeSeconds = 0;
-      cs.playTimeSamples = 0;
-      /* Start decoding without recreating the decoding tables from header. */
-      // putch('+');
-#ifdef HAS_PATCHCODVORBISDECODE
-      /* available in latest dev1000.h */
-      return PatchCodVorbisDecode (&codecVorbis, &cs, &eStr, 0);
-#else
-      return CodVorbisDecode (&codecVorbis, &cs, &eStr);
-#endif
-    }
-    /* 'OggS' Not found, must be a file with different parameters (or WAV) */
-    // putch('-');
-    Seek (0);
-    return PatchPlayCurrentFile ();
+    return ret;
   }
-  // putch('n');
-  return PatchPlayCurrentFile ();
+  return PlayNewVorbisSetup ();
 }
 #endif /*GAPLESS*/
 #endif /* elseUSE_WAV */
@@ -0,0 +1,109 @@
+/// \file sectorcache.c LRU disk sector cache at the ReadDiskSector hook
+/*
+
+   minifat reads every sector into its single minifatBuffer, so opening
+   a file through the ROM, walking a cluster chain or iterating over the
+   free space reads the same FAT and directory sectors from the SPI flash
+   again and again. This cache keeps the most recently used sectors in
+   Y RAM that is otherwise idle between files: it is started by the main
+   loop while no file is being decoded and USB is not attached, and
+   stopped, which drops its contents, before the decoder or the USB
+   mapper take the memory.
+
+   sectorCacheHits and sectorCacheMisses count the reads since the cache
+   was last started.
+
+*/
+
+#include "system.h"
+
+#include <stdio.h>  // Standard io
+#include <stdlib.h> // VS_DSP Standard Library
+#include <vs1000.h> // VS1000B register definitions
+#include <minifat.h>  // Read Only Fat Filesystem
+#include <string.h> // memcpy etc
+
+#include "spiflash.h"
+#include "sectorcache.h"
+
+#if USE_SECTOR_CACHE
+
+__y u_int16 *sectorCacheMem;  /* NULL when stopped */
+u_int16 sectorCacheSize;
+u_int32 sectorCacheSector[SECTOR_CACHE_MAX];
+u_int16 sectorCacheUsed[SECTOR_CACHE_MAX]; /* age stamp, 0 if empty */
+u_int16 sectorCacheClock;
+u_int16 sectorCacheHits, sectorCacheMisses;
+
+// Start caching in sectors 256-word sectors at mem
+void SectorCacheStart (__y u_int16 * mem, u_int16 sectors)
+{
+  if (sectors > SECTOR_CACHE_MAX)
+  {
+    sectors = SECTOR_CACHE_MAX;
+  }
+  memset (sectorCacheUsed, 0, sizeof (sectorCacheUsed));
+  sectorCacheClock = 0;
+  sectorCacheHits = sectorCacheMisses = 0;
+  sectorCacheSize = sectors;
+  sectorCacheMem = mem;
+}
+
+// Stop caching and forget the cached sectors, the memory is needed
+void SectorCacheStop (void)
+{
+  if (sectorCacheMem)
+  {
+    do__not__puthex (sectorCacheHits);
+    do__not__puthex (sectorCacheMisses);
+    do__not__puts ("=sector cache hits, misses");
+  }
+  sectorCacheMem = NULL;
+}
+
+// ReadDiskSector hook: read from the cache, or through the mapper and
+// keep a copy in place of the least recently used sector
+auto u_int16 CachedReadDiskSector (register __i0 u_int16 * buffer,
+                                   register __reg_a u_int32 sector)
+{
+  register u_int16 i, oldest = 0;
+
+  if (!sectorCacheMem)
+  {
+    return MapperReadDiskSector (buffer, sector);
+  }
+  if (!++sectorCacheClock)
+  { // wrapped: restart the ages, keeping the contents
+    for (i = 0; i < sectorCacheSize; i++)
+    {
+      if (sectorCacheUsed[i])
+        sectorCacheUsed[i] = 1;
+    }
+    sectorCacheClock = 2;
+  }
+  for (i = 0; i < sectorCacheSize; i++)
+  {
+    if (sectorCacheUsed[i] && sectorCacheSector[i] == sector)
+    {
+      sectorCacheUsed[i] = sectorCacheClock;
+      sectorCacheHits++;
+      memcpyYX (buffer, sectorCacheMem + 256 * i, 256);
+      return 0;
+    }
+    if (sectorCacheUsed[i] < sectorCacheUsed[oldest])
+    {
+      oldest = i;
+    }
+  }
+  sectorCacheMisses++;
+  i = MapperReadDiskSector (buffer, sector);
+  if (i)
+  { // not read, don't keep it
+    return i;
+  }
+  sectorCacheSector[oldest] = sector;
+  sectorCacheUsed[oldest] = sectorCacheClock;
+  memcpyXY (sectorCacheMem + 256 * oldest, buffer, 256);
+  return 0;
+}
+#endif /* USE_SECTOR_CACHE */
@@ -0,0 +1,23 @@
+/// \file sectorcache.h LRU disk sector cache at the ReadDiskSector hook
+#ifndef __SECTORCACHE_H__
+#define __SECTORCACHE_H__
+
+// Most sectors cached, the part of mallocAreaY below the mapper
+// WORKSPACE, which the file index is built in
+#define SECTOR_CACHE_MAX 24
+
+#ifdef ASM
+
+#else /*ASM*/
+#include <vstypes.h>
+
+extern u_int16 sectorCacheHits, sectorCacheMisses;
+
+void SectorCacheStart (__y u_int16 * mem, u_int16 sectors);
+void SectorCacheStop (void);
+auto u_int16 CachedReadDiskSector (register __i0 u_int16 * buffer,
+                                   register __reg_a u_int32 sector);
+
+#endif /* elseASM */
+
+#endif /* !__SECTORCACHE_H__ */
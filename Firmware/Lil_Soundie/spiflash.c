@@ -0,0 +1,1818 @@
+/// \file spiflash.c SPI flash logical disk mapper with 4K sector RAM cache
+/*
+
+   Copyright 2008 VLSI Solution, Tampere, Finland. Absolutely no warranty.
+
+   Uses the 18 kilobytes of mallocAreaY as a disk read/write cache and
+   work area for erasing and programming the SPI flash in 4 kilobyte
+   chunks. See spiusb.c for a description of the whole system.
+
+*/
+
+#include <stdio.h>  // Standard io
+#include <stdlib.h> // VS_DSP Standard Library
+#include <vs1000.h> // VS1000B register definitions
+#include <vectors.h>  // VS1000B vectors (interrupts and services)
+#include <mapper.h> // Logical Disk
+#include <string.h> // memcpy etc
+#include <player.h> // VS1000B default ROM player
+#include <audio.h>  // timeCount
+#include <mappertiny.h>
+#include <usb.h>
+#include <scsi.h> // SCSI.BlocksLeftToReceive
+
+#include "system.h"
+#include "spiflash.h"
+
+/* cache info */
+u_int16 blockPresent;
+u_int16 blockAddress[CACHE_BLOCKS];
+s_int16 lastFoundBlock = -1;
+u_int16 shouldFlush = 0;
+
+/* BLOCK_SUMS and PREFETCH are in use. Set by FsMapSpiFlashCalibrate()
+   on USB attach, cleared by spiusb.c before the player takes mallocAreaY
+   back. The checksums are of the blocks as they are in flash, see
+   BlockDiffers(); 0 is not known. They are learned from reads and
+   write-backs and forgotten when a sector is erased. */
+u_int16 usbBuffersInUse;
+
+/* Block in PREFETCH if prefetchValid, how many of its words are there,
+   and whether the READ command is still open after them. hostReadNext
+   is the block after the last one the host has read. See
+   PrefetchNextBlock(). Every block number is a real block on a 32 MB
+   chip, so none of them can stand for no block. */
+u_int16 prefetchBlock;
+u_int16 prefetchValid;
+u_int16 prefetchWords;
+u_int16 prefetchOpen;
+u_int32 hostReadNext;
+
+/* Index of cached blocks keyed on their 4K sector, so that a block
+   lookup or insert is a hash probe instead of a scan of all slots. At
+   most CACHE_BLOCKS sectors can be resident, so all entries may be in
+   use at once. A lookup stops after SECTOR_INDEX_SIZE probes instead of
+   at an unused entry. An insert is only done for a free cache slot, and
+   a removal has just emptied an entry, so both find an unused one. */
+struct CachedSector
+{
+  u_int16 lba;  /* first block of the 4K sector */
+  u_int16 blocks; /* bit k set: block lba+k is cached; 0: entry unused */
+  u_int16 slot[2];  /* cache slot of block k in nibble k&3 of slot[k>>2] */
+  u_int16 stamp;  /* cacheClock at the last write to the sector */
+};
+#define SECTOR_INDEX_SIZE 16  /* power of two, at least CACHE_BLOCKS */
+#define SECTOR_HASH(lba) (((lba) >> 3) & (SECTOR_INDEX_SIZE - 1))
+struct CachedSector sectorIndex[SECTOR_INDEX_SIZE];
+u_int16 cacheClock;
+
+/* FAT and root directory blocks [metaStart, metaEnd) of the disk, learned
+   from the boot sector the host reads or writes. Their sectors are
+   rewritten after every file during a copy, so they are kept in the cache
+   until the host has been quiet for WRITE_BACK_DELAY. */
+u_int16 metaStart, metaEnd;
+u_int32 lastWriteTime;
+#define WRITE_BACK_DELAY (2 * TIMER_TICKS)
+#define IS_PINNED(lba) ((lba) + 8 > metaStart && (lba) < metaEnd)
+
+/* 4K sectors of the chip known to be erased, one bit per sector. Nothing
+   is known at power-up; the state is learned from full sector reads and
+   kept up to date on every erase and program. */
+u_int16 sectorErased[MAX_CHIP_BLOCKS / 128];
+/* 4K sectors the file system has freed, see FsMapSpiFlashFree(). Their
+   old contents need not be kept: the next write-back neither reads them
+   back nor compares with them, and FsMapSpiFlashPreErase() erases them
+   ahead of time. A sector stops being free when the host writes to it,
+   even if the write is skipped as redundant, and the whole map is
+   forgotten before it is learned again and on USB attach, see
+   FsMapSpiFlashForgetFree(). */
+u_int16 sectorFree[MAX_CHIP_BLOCKS / 128];
+/* Next block FsMapSpiFlashPreErase() looks at, chipBlocks until the map
+   has been learned from the FAT of the disk as it is now, see
+   FsMapSpiFlashFreeDone() */
+u_int32 preEraseNext;
+#define SECTOR_WORD(blockn) ((blockn) >> 7)
+#define SECTOR_BIT(blockn) (1 << (((blockn) >> 3) & 15))
+
+/* Background write-back of one 4K sector. The sector is merged into
+   WORKSPACE and then erased and programmed one SPI operation at a time
+   by FsMapSpiFlashStep(), so that the USB loop keeps running while the
+   flash is busy. Its cache slots are freed when it is done; until then
+   the sector is read from WORKSPACE. The same machinery erases without
+   programming, with no cache slots, see StartErase(). */
+u_int16 wbState;  /* next operation, WB_IDLE if no write-back */
+u_int16 wbLba;  /* first block of the sector */
+u_int16 wbPages;  /* 256-byte pages still to program */
+u_int16 wbSlots;  /* cache slots of the sector */
+s_int16 wbErased; /* sector state when done, -1 if unchanged */
+u_int16 wbEraseBlocks;  /* 8, or 64/128 for a 32K/64K erase, the range
+                           IN_ERASE() reads as erased */
+u_int16 wbEraseCommand;
+u_int16 eraseSuspended; /* the erase has been suspended for a file open */
+#define WB_IDLE 0
+#define WB_UNPROTECT_ERASE 1
+#define WB_ERASE 2
+#define WB_UNPROTECT 3
+#define WB_PROGRAM 4
+
+#if USE_FILE_INDEX
+/* The file index sector has been erased or checked to hold no index
+   since the index was last written, see DropFileIndex() */
+u_int16 fileIndexDropped;
+#endif
+
+/* Where the host WRITE(10) being received goes on, and the block before
+   which it is known to end, see FsMapSpiFlashWrite() */
+u_int32 hostNext, hostEnd;
+/* Block is in the 4K sector being written back from WORKSPACE */
+#define IN_WRITE_BACK(blockn) (wbState != WB_IDLE && wbSlots \
+                               && ((blockn) & 0xfff8) == wbLba)
+/* Block is being erased, or is about to be, by StartErase() */
+#define IN_ERASE(blockn) (wbState != WB_IDLE && !wbSlots && !wbPages \
+                          && (u_int16) ((blockn) - wbLba) < wbEraseBlocks)
+
+/* Block the READ command is positioned at, if readOpen. xCS is left low
+   after a block read, so that reading on sequentially only clocks in
+   data, also across mapper calls. Every other command starts in
+   SingleCycleCommand(), SpiWaitStatus() or EeBusy(), which end the
+   read. */
+u_int16 readNext;
+u_int16 readOpen;
+
+/* Read mode chosen by FsMapSpiFlashCalibrate() */
+u_int16 spiReadCommand;
+u_int16 spiClockDivider = SPI_CLOCK_DIVIDER;
+
+/* Chip geometry and commands learned by EeIdentify() */
+u_int32 chipBlocks; /* 512-byte blocks used, at most MAX_CHIP_BLOCKS */
+u_int16 readCommand, fastReadCommand, programCommand; /* fast read 0: none */
+u_int16 erase4KCommand, erase32KCommand, erase64KCommand; /* 0: none */
+u_int16 eraseSuspendCommand, eraseResumeCommand; /* 0: none */
+u_int16 use4ByteAddress;  /* chip is used above 16 MB */
+
+#if PRINT_VS3EMU_DEBUG_MESSAGES
+__y const char hex[] = "0123456789abcdef";
+void puthex (u_int16 a)
+{
+  char tmp[6];
+  tmp[0] = hex[(a >> 12) & 15];
+  tmp[1] = hex[(a >> 8) & 15];
+  tmp[2] = hex[(a >> 4) & 15];
+  tmp[3] = hex[(a >> 0) & 15];
+  tmp[4] = ' ';
+  tmp[5] = '\0';
+  fputs (tmp, stdout);
+}
+
+void PrintCache ()
+{
+  register u_int16 i;
+  for (i = 0; i < CACHE_BLOCKS; i++)
+  {
+    if (blockPresent & 1 << i)
+    {
+      puthex (blockAddress[i]);
+    }
+    else
+    {
+      fputs ("- ", stdout);
+    }
+  }
+  puts ("=cache");
+}
+#endif
+
+#define SPI_EEPROM_COMMAND_WRITE_ENABLE  0x06
+#define SPI_EEPROM_COMMAND_WRITE_DISABLE  0x04
+#define SPI_EEPROM_COMMAND_READ_STATUS_REGISTER  0x05
+#define SPI_EEPROM_COMMAND_WRITE_STATUS_REGISTER  0x01
+#define SPI_EEPROM_COMMAND_READ  0x03
+#define SPI_EEPROM_COMMAND_FAST_READ  0x0B
+#define SPI_EEPROM_COMMAND_WRITE 0x02
+#define SPI_EEPROM_COMMAND_CLEAR_ERROR_FLAGS 0x30
+#define SPI_EEPROM_COMMAND_ERASE_BLOCK 0xD8
+#define SPI_EEPROM_COMMAND_ERASE_SECTOR 0x20
+#define SPI_EEPROM_COMMAND_ERASE_CHIP 0xC7
+#define SPI_EEPROM_COMMAND_READ_JEDEC_ID 0x9F
+#define SPI_EEPROM_COMMAND_READ_SFDP 0x5A
+#define SPI_EEPROM_COMMAND_ENTER_4BYTE_MODE 0xB7
+
+// Commands with a 4-byte address, erase opcodes come from SFDP
+#define SPI_EEPROM_COMMAND_READ_4B 0x13
+#define SPI_EEPROM_COMMAND_FAST_READ_4B 0x0C
+#define SPI_EEPROM_COMMAND_WRITE_4B 0x12
+
+// Clock divider for reading the reference copy in calibration
+#define SPI_CALIBRATION_DIVIDER 8
+
+// Erased flash as seen by the host
+#if USE_INVERTED_DISK_DATA
+#define ERASED_DATA 0x0000
+#else
+#define ERASED_DATA 0xffff
+#endif
+
+//macro to set SPI to MASTER; 8BIT; FSYNC Idle => xCS high
+#define SPI_MASTER_8BIT_CSHI   PERIP(SPI0_CONFIG) = \
+                                                    SPI_CF_MASTER | SPI_CF_DLEN8 | SPI_CF_FSIDLE1
+
+//macro to set SPI to MASTER; 8BIT; FSYNC not Idle => xCS low
+#define SPI_MASTER_8BIT_CSLO   PERIP(SPI0_CONFIG) = \
+                                                    SPI_CF_MASTER | SPI_CF_DLEN8 | SPI_CF_FSIDLE0
+
+//macro to set SPI to MASTER; 16BIT; FSYNC not Idle => xCS low
+#define SPI_MASTER_16BIT_CSLO  PERIP(SPI0_CONFIG) = \
+                                                    SPI_CF_MASTER | SPI_CF_DLEN16 | SPI_CF_FSIDLE0
+
+// End an open READ
+void EeEndRead (void)
+{
+  readOpen = 0;
+  prefetchOpen = 0;
+  SPI_MASTER_8BIT_CSHI;
+}
+
+void SingleCycleCommand (u_int16 cmd)
+{
+  EeEndRead ();
+  SPI_MASTER_8BIT_CSLO;
+  SpiSendReceive (cmd);
+  SPI_MASTER_8BIT_CSHI;
+}
+
+/// Wait for not_busy (status[0] = 0) and return status
+s_int16 SpiWaitStatus (void)
+{
+  u_int16 status;
+  EeEndRead ();
+  SPI_MASTER_8BIT_CSLO;
+  SpiSendReceive (SPI_EEPROM_COMMAND_READ_STATUS_REGISTER);
+  do
+  {
+    status = SpiSendReceive (0);
+    if (PERIP (USB_STATUS) & USB_STF_BUS_RESET)
+    {
+      USBHandler ();
+      SPI_MASTER_8BIT_CSHI;
+      return -1;  /* USB HAS BEEN RESET */
+    }
+  }
+  while (status & 0x01);
+  ; // Wait until chip is ready or return -1 if USB bus reset
+
+  SPI_MASTER_8BIT_CSHI;
+
+  return status;
+}
+
+
+/// Returns 1 if the chip is busy, without waiting
+u_int16 EeBusy (void)
+{
+  u_int16 status;
+  EeEndRead ();
+  SPI_MASTER_8BIT_CSLO;
+  SpiSendReceive (SPI_EEPROM_COMMAND_READ_STATUS_REGISTER);
+  status = SpiSendReceive (0);
+  SPI_MASTER_8BIT_CSHI;
+  return status & 0x01;
+}
+
+// Start the status register write, the chip is busy until it is done
+void EeStartUnprotect (void)
+{
+  SingleCycleCommand (SPI_EEPROM_COMMAND_WRITE_ENABLE);
+  SPI_MASTER_8BIT_CSLO;
+  SpiSendReceive (SPI_EEPROM_COMMAND_WRITE_STATUS_REGISTER);
+  SpiSendReceive (0x02);  // Sector Protections Off
+  SPI_MASTER_8BIT_CSHI;
+}
+
+// Send the address of byte offset bytes from the start of block blockn
+void EePutAddress (register u_int16 blockn, u_int16 bytes)
+{
+  u_int32 a = ((u_int32) blockn << 9) + bytes;
+  if (use4ByteAddress)
+    SpiSendReceive ((u_int16) (a >> 24) & 0xff);
+  SpiSendReceive ((u_int16) (a >> 16) & 0xff);
+  SpiSendReceive ((u_int16) (a >> 8) & 0xff);
+  SpiSendReceive ((u_int16) a & 0xff);
+}
+
+// Start a READ at word offset words from the start of block blockn
+void EePutReadAddress (register u_int16 blockn, u_int16 words)
+{
+  SPI_MASTER_8BIT_CSLO;
+  SpiSendReceive (spiReadCommand);
+  EePutAddress (blockn, words << 1);
+  if (spiReadCommand == fastReadCommand)
+    SpiSendReceive (0); // dummy byte
+  SPI_MASTER_16BIT_CSLO;
+}
+
+void EePutReadBlockAddress (register u_int16 blockn)
+{
+  EePutReadAddress (blockn, 0);
+}
+
+// Record erase state of the sector of blockn: 1 erased, 0 not, -1 unknown
+void SetSectorState (u_int16 blockn, s_int16 erased)
+{
+  if (erased > 0)
+  {
+    sectorErased[SECTOR_WORD (blockn)] |= SECTOR_BIT (blockn);
+    if (usbBuffersInUse && blockn < BLOCK_SUM_BLOCKS)
+      memsetY (BLOCK_SUMS + ((blockn & 0xfff8) >> 1), 0, 4);
+  }
+  else
+    sectorErased[SECTOR_WORD (blockn)] &= ~SECTOR_BIT (blockn);
+}
+
+// 8-bit checksum of a 512-byte block, never 0
+u_int16 BlockSum (register u_int16 * p)
+{
+  register u_int16 i, a = 0, b = 0;
+  for (i = 0; i < 256; i++)
+  {
+    a += *p++;
+    b += a;
+  }
+  a = (a ^ b ^ (b >> 8)) & 0xff;
+  return a ? a : 1;
+}
+
+u_int16 BlockSumY (register __y u_int16 * p)
+{
+  register u_int16 i, a = 0, b = 0;
+  for (i = 0; i < 256; i++)
+  {
+    a += *p++;
+    b += a;
+  }
+  a = (a ^ b ^ (b >> 8)) & 0xff;
+  return a ? a : 1;
+}
+
+// Remember the checksum of block blockn as it is in flash
+void SetBlockSum (u_int16 blockn, u_int16 sum)
+{
+  if (usbBuffersInUse && blockn < BLOCK_SUM_BLOCKS)
+  {
+    register __y u_int16 *p = BLOCK_SUMS + (blockn >> 1);
+    if (blockn & 1)
+      *p = (*p & 0xff00) | sum;
+    else
+      *p = (*p & 0x00ff) | (sum << 8);
+  }
+}
+
+// Returns the checksum of block blockn in flash, 0 if not known
+u_int16 GetBlockSum (u_int16 blockn)
+{
+  if (!usbBuffersInUse || blockn >= BLOCK_SUM_BLOCKS)
+    return 0;
+  if (blockn & 1)
+    return BLOCK_SUMS[blockn >> 1] & 0xff;
+  return BLOCK_SUMS[blockn >> 1] >> 8;
+}
+
+// Returns 1 if the sector of blockn is known to be erased
+u_int16 IsSectorErased (u_int16 blockn)
+{
+  return (sectorErased[SECTOR_WORD (blockn)] & SECTOR_BIT (blockn)) != 0;
+}
+
+// Returns 1 if the file system has freed the whole sector of blockn
+u_int16 IsSectorFree (u_int16 blockn)
+{
+  return (sectorFree[SECTOR_WORD (blockn)] & SECTOR_BIT (blockn)) != 0;
+}
+
+// Compare a 4K sector in flash with new data for it. Returns a bitmask
+// of the 256-byte pages that differ. Programming can only clear bits, so
+// if any bit would have to go from 0 to 1, *needErase is set and the
+// compare stops there.
+u_int16 EeCompare4K (u_int16 blockn, __y u_int16 * dptr, u_int16 * needErase)
+{
+  register u_int16 pages = 0;
+  *needErase = 0;
+  SpiWaitStatus ();
+  EePutReadBlockAddress (blockn);
+  {
+    register u_int16 n;
+    for (n = 0; n < 2048; n++)
+    {
+      register u_int16 old = SpiSendReceive (0);
+#if USE_INVERTED_DISK_DATA
+      register u_int16 new = ~(*dptr++);
+#else
+      register u_int16 new = *dptr++;
+#endif
+      if (old != new)
+      {
+        if ((old & new) != new)
+        {
+          *needErase = 1;
+          break;
+        }
+        pages |= 1 << (n >> 7);
+      }
+    }
+  }
+  SPI_MASTER_8BIT_CSHI;
+  return pages;
+}
+
+// Returns 1 if the 4K sector at blockn is in the erased state
+u_int16 EeIsErased4K (u_int16 blockn)
+{
+  register u_int16 n;
+  SpiWaitStatus ();
+  EePutReadBlockAddress (blockn);
+  for (n = 0; n < 2048; n++)
+  {
+    if (SpiSendReceive (0) != 0xffff)
+      break;
+  }
+  SPI_MASTER_8BIT_CSHI;
+  return n == 2048;
+}
+
+// Start erasing the 4K, 32K or 64K block at blockn with command,
+// write must be enabled
+void EeStartErase (u_int16 blockn, u_int16 command)
+{
+  SPI_MASTER_8BIT_CSLO;
+  SpiSendReceive (command);
+  EePutAddress (blockn, 0);
+  SPI_MASTER_8BIT_CSHI;
+}
+
+// Start programming one 256-byte page (0..15) of the 4K sector starting
+// at blockn, write must be enabled
+void EeStartPageProgram (u_int16 blockn, u_int16 page, __y u_int16 * dptr)
+{
+  SPI_MASTER_8BIT_CSLO;
+  SpiSendReceive (programCommand);
+  EePutAddress (blockn, page << 8);
+  SPI_MASTER_16BIT_CSLO;
+  {
+    u_int16 n;
+    for (n = 0; n < 128; n++)
+    {
+#if USE_INVERTED_DISK_DATA
+      SpiSendReceive (~(*dptr++));
+#else
+      SpiSendReceive ((*dptr++));
+#endif
+    }
+  }
+  SPI_MASTER_8BIT_CSHI;
+}
+
+// Returns a mask of the 256-byte pages of a 4K sector in RAM that are not
+// all in the erased state. Only these need programming after an erase.
+u_int16 NonBlankPages (__y u_int16 * dptr)
+{
+  register u_int16 i, n, pages = 0;
+  for (i = 0; i < 16; i++)
+  {
+    for (n = 0; n < 128; n++)
+    {
+      if (dptr[n] != ERASED_DATA)
+      {
+        pages |= 1 << i;
+        break;
+      }
+    }
+    dptr += 128;
+  }
+  return pages;
+}
+
+// Returns 1 if data would be in the erased state in flash
+u_int16 IsBlankData (u_int16 * dptr, u_int16 words)
+{
+  while (words--)
+  {
+    if (*dptr++ != ERASED_DATA)
+      return 0;
+  }
+  return 1;
+}
+
+// Compare new contents of a 512-byte block with the old contents, both in
+// RAM as seen by the host. Returns a mask of the two 256-byte pages that
+// differ, and sets *needErase if the change needs more than programming.
+u_int16 CompareBlockYY (__y u_int16 * old, __y u_int16 * dptr,
+                        u_int16 * needErase)
+{
+  register u_int16 n, pages = 0;
+  for (n = 0; n < 256; n++)
+  {
+    register u_int16 o = *old++, w = *dptr++;
+    if (o != w)
+    {
+      pages |= 1 << (n >> 7);
+#if USE_INVERTED_DISK_DATA
+      if (o & ~w)
+#else
+      if (w & ~o)
+#endif
+        *needErase = 1;
+    }
+  }
+  return pages;
+}
+
+
+
+// Block Read for SPI EEPROMS with 24-bit address e.g. up to 16MB.
+// Continues the open READ if it is at blockn, and leaves it open.
+u_int16 EeReadBlock (u_int16 blockn, u_int16 * dptr)
+{
+  if (!readOpen || blockn != readNext)
+  {
+    SpiWaitStatus ();
+    EePutReadBlockAddress (blockn);
+  }
+  {
+    int n;
+    for (n = 0; n < 256; n++)
+    {
+#if USE_INVERTED_DISK_DATA
+      *dptr++ = ~SpiSendReceive (0);
+#else
+      *dptr++ = SpiSendReceive (0);
+#endif
+    }
+  }
+  readNext = blockn + 1;
+  readOpen = readNext != 0; /* the READ goes on above 32 MB, not at 0 */
+  if (usbBuffersInUse)
+    SetBlockSum (blockn, BlockSum (dptr - 256));
+  return 0;
+}
+
+// Returns 1 if block differs from data, 0 if block is the same
+u_int16 EeCompareBlock (u_int16 blockn, u_int16 * dptr)
+{
+  SpiWaitStatus ();
+
+  EePutReadBlockAddress (blockn);
+  {
+    int n;
+    for (n = 0; n < 256; n++)
+    {
+
+#if USE_INVERTED_DISK_DATA
+      if ((*dptr++) != (u_int16) (~SpiSendReceive (0)))
+#else
+      if ((*dptr++) != (SpiSendReceive (0)))
+#endif
+      {
+        SPI_MASTER_8BIT_CSHI;
+        return 1;
+      }
+    }
+  }
+  SPI_MASTER_8BIT_CSHI;
+  return 0;
+}
+
+// Read up to n more words of prefetchBlock into PREFETCH. Goes on with
+// the READ command of the previous call if nothing has used the bus
+// since, otherwise starts the block again.
+void PrefetchWords (register u_int16 n)
+{
+  register __y u_int16 *d;
+
+  if (prefetchWords == 256)
+    return;
+  if (prefetchWords == 0 || !prefetchOpen)
+  {
+    prefetchWords = 0;
+    if (!readOpen || prefetchBlock != readNext)
+    {
+      SpiWaitStatus ();
+      EePutReadBlockAddress (prefetchBlock);
+    }
+    prefetchOpen = 1;
+  }
+  if (n > 256 - prefetchWords)
+    n = 256 - prefetchWords;
+  d = PREFETCH + prefetchWords;
+  prefetchWords += n;
+  while (n--)
+  {
+#if USE_INVERTED_DISK_DATA
+    *d++ = ~SpiSendReceive (0);
+#else
+    *d++ = SpiSendReceive (0);
+#endif
+  }
+  // The READ is only at a block boundary once the block is complete
+  readOpen = 0;
+  if (prefetchWords == 256)
+  {
+    readNext = prefetchBlock + 1;
+    readOpen = readNext != 0;
+    prefetchOpen = 0;
+    SetBlockSum (prefetchBlock, BlockSumY (PREFETCH));
+  }
+}
+
+// Returns 1 if data differs from block blockn in flash. A known checksum
+// that does not match tells that without reading the block back, which
+// would also have to wait for the flash to finish any write-back.
+u_int16 BlockDiffers (u_int16 blockn, u_int16 * data)
+{
+  register u_int16 sum = BlockSum (data), old = GetBlockSum (blockn);
+  if (old && old != sum)
+    return 1;
+  if (EeCompareBlock (blockn, data))
+    return 1;
+  SetBlockSum (blockn, sum);
+  return 0;
+}
+
+u_int16 EeRead4KSectorYToWorkspace (u_int16 blockn)
+{
+  register __y u_int16 *dptr;
+  dptr = WORKSPACE;
+  SpiWaitStatus ();
+  blockn &= 0xfff8; // always point to first block of 4k sector
+
+
+  EePutReadBlockAddress (blockn);
+  {
+    int n;
+    register u_int16 all = 0xffff;
+    for (n = 0; n < 2048; n++)
+    {
+      register u_int16 w = SpiSendReceive (0);
+      all &= w;
+#if USE_INVERTED_DISK_DATA
+      *dptr++ = ~w;
+#else
+      *dptr++ = w;
+#endif
+    }
+    SetSectorState (blockn, all == 0xffff);
+  }
+  SPI_MASTER_8BIT_CSHI;
+  return 0;
+}
+
+void InitSpi (u_int16 clockDivider)
+{
+  EeEndRead ();
+  PERIP (SPI0_FSYNC) = 0;
+  PERIP (SPI0_CLKCONFIG) = SPI_CC_CLKDIV * (clockDivider - 1);
+  PERIP (GPIO1_MODE) |= 0x1f; /* enable SPI pins */
+}
+
+// Read a little-endian 32-bit word of the SFDP tables at addr
+u_int32 EeReadSfdp (u_int16 addr)
+{
+  register u_int16 i;
+  u_int32 d = 0;
+  SpiWaitStatus ();
+  SPI_MASTER_8BIT_CSLO;
+  SpiSendReceive (SPI_EEPROM_COMMAND_READ_SFDP);
+  SpiSendReceive (0); // Address[23:16]
+  SpiSendReceive (addr >> 8); // Address[15:8]
+  SpiSendReceive (addr & 0xff); // Address[7:0]
+  SpiSendReceive (0); // dummy byte
+  for (i = 0; i < 32; i += 8)
+  {
+    d |= (u_int32) (SpiSendReceive (0) & 0xff) << i;
+  }
+  SPI_MASTER_8BIT_CSHI;
+  return d;
+}
+
+// Learn the size and erase commands of the chip from the JEDEC basic
+// flash parameter table of its SFDP area, or failing that the size from
+// its JEDEC ID. A chip that tells nothing is taken to be
+// CHIP_TOTAL_BLOCKS blocks with 4K and 64K erase. Above 16 MB the 4-byte
+// address commands are used if the 4-byte address instruction table
+// lists them all, otherwise the chip is put to 4-byte address mode.
+void EeIdentify (void)
+{
+  u_int16 id[3], i, addressModes = 0, eraseTypes[4];
+  u_int32 bytes = CHIP_TOTAL_BLOCKS * 512L, d;
+#if MAX_CHIP_BLOCKS > 32768
+  u_int32 fourByte = 0, fourByteErase = 0; /* 4BAIT DWORDs 1 and 2 */
+#endif
+
+  readCommand = SPI_EEPROM_COMMAND_READ;
+  fastReadCommand = SPI_EEPROM_COMMAND_FAST_READ;
+  programCommand = SPI_EEPROM_COMMAND_WRITE;
+  erase4KCommand = SPI_EEPROM_COMMAND_ERASE_SECTOR;
+  erase32KCommand = 0;
+  erase64KCommand = SPI_EEPROM_COMMAND_ERASE_BLOCK;
+  eraseSuspendCommand = eraseResumeCommand = 0;
+  use4ByteAddress = 0;
+  memset (eraseTypes, 0, sizeof (eraseTypes));
+
+  SpiWaitStatus ();
+  SPI_MASTER_8BIT_CSLO;
+  SpiSendReceive (SPI_EEPROM_COMMAND_READ_JEDEC_ID);
+  for (i = 0; i < 3; i++)
+  {
+    id[i] = SpiSendReceive (0) & 0xff;
+  }
+  SPI_MASTER_8BIT_CSHI;
+  do__not__puthex (id[0]);
+  do__not__puthex ((id[1] << 8) | id[2]);
+  do__not__puts ("=JEDEC ID");
+  if (id[0] == 0x1f)
+  { // Atmel/Adesto: density code in the device ID, 4 = 4 Mbit
+    if ((id[1] & 0x1f) >= 1 && (id[1] & 0x1f) <= 10)
+      bytes = 1L << ((id[1] & 0x1f) + 15);
+  }
+  else if (id[0] != 0xff && id[2] >= 0x10 && id[2] <= 0x1f)
+  { // most others: capacity code = log2 of bytes
+    bytes = 1L << id[2];
+  }
+
+  if (EeReadSfdp (0) == 0x50444653L) // "SFDP"
+  {
+    u_int32 header = EeReadSfdp (8); // first parameter header is JEDEC's
+    u_int16 table = (u_int16) EeReadSfdp (12);
+#if MAX_CHIP_BLOCKS > 32768
+    u_int16 headers = ((u_int16) (EeReadSfdp (4) >> 16) & 0xff) + 1;
+#endif
+    if ((header & 0xff) == 0 && (header >> 24) >= 9)
+    {
+      d = EeReadSfdp (table); // DWORD 1
+      addressModes = (d >> 17) & 3;
+      d = EeReadSfdp (table + 4); // DWORD 2: density in bits
+      if (!(d & 0x80000000L))
+        bytes = (d >> 3) + 1;
+      else if ((d & 0x7fffffffL) < 35)
+        bytes = 1L << ((d & 0x7fffffffL) - 3);
+      erase4KCommand = erase64KCommand = 0;
+      for (i = 0; i < 4; i++)
+      { // DWORDs 8 and 9: erase types as size exponent, opcode
+        eraseTypes[i] = (u_int16) (EeReadSfdp (table + 28 + (i >> 1) * 4)
+                                   >> ((i & 1) * 16));
+        d = eraseTypes[i];
+        if ((d & 0xff) == 12)
+          erase4KCommand = (d >> 8) & 0xff;
+        if ((d & 0xff) == 15)
+          erase32KCommand = (d >> 8) & 0xff;
+        if ((d & 0xff) == 16)
+          erase64KCommand = (d >> 8) & 0xff;
+      }
+      // DWORD 12 bit 31 clear: DWORD 13 holds the suspend and resume
+      // commands, erase suspend in bits 31:24, resume in bits 23:16
+      if ((header >> 24) >= 13 && !(EeReadSfdp (table + 44) & 0x80000000L))
+      {
+        d = EeReadSfdp (table + 48);
+        eraseSuspendCommand = (u_int16) (d >> 24) & 0xff;
+        eraseResumeCommand = (u_int16) (d >> 16) & 0xff;
+      }
+    }
+#if MAX_CHIP_BLOCKS > 32768
+    for (i = 1; i < headers && i < 8; i++)
+    { // 4-byte address instruction table, ID FF84h
+      header = EeReadSfdp (8 + 8 * i);
+      d = EeReadSfdp (12 + 8 * i);
+      if ((header & 0xff) == 0x84 && (d >> 24) == 0xff
+          && (header >> 24) >= 2)
+      {
+        fourByte = EeReadSfdp ((u_int16) d);
+        fourByteErase = EeReadSfdp ((u_int16) d + 4);
+      }
+    }
+#endif
+  }
+  if (!erase4KCommand)
+  { // the cache works in 4K sectors, try the usual command
+    erase4KCommand = SPI_EEPROM_COMMAND_ERASE_SECTOR;
+  }
+
+  chipBlocks = bytes >> 9;
+  if (chipBlocks > MAX_CHIP_BLOCKS)
+    chipBlocks = MAX_CHIP_BLOCKS;
+  // Above 16 MB, or if the chip only takes them, use 4-byte addresses
+  if (addressModes == 2 || (addressModes == 1 && chipBlocks > 32768L))
+  {
+    use4ByteAddress = 1;
+  }
+  else if (chipBlocks > 32768L)
+  {
+    chipBlocks = 32768L;
+  }
+#if MAX_CHIP_BLOCKS > 32768
+  if (use4ByteAddress && addressModes == 1)
+  {
+    u_int16 e4K = 0, e32K = 0, e64K = 0;
+    for (i = 0; i < 4; i++)
+    { // 4-byte opcode of erase type i, 0 if the table does not list it
+      u_int16 e = (fourByte & (1L << (9 + i))) ?
+        (u_int16) (fourByteErase >> (8 * i)) & 0xff : 0;
+      if ((eraseTypes[i] & 0xff) == 12)
+        e4K = e;
+      if ((eraseTypes[i] & 0xff) == 15)
+        e32K = e;
+      if ((eraseTypes[i] & 0xff) == 16)
+        e64K = e;
+    }
+    if ((fourByte & 0x41) == 0x41 && e4K) // READ 13h and PAGE PROGRAM 12h
+    {
+      readCommand = SPI_EEPROM_COMMAND_READ_4B;
+      fastReadCommand = (fourByte & 2) ? SPI_EEPROM_COMMAND_FAST_READ_4B : 0;
+      programCommand = SPI_EEPROM_COMMAND_WRITE_4B;
+      erase4KCommand = e4K;
+      erase32KCommand = e32K;
+      erase64KCommand = e64K;
+    }
+    else
+    {
+      // The usual commands take 4-byte addresses from now on. The chip
+      // stays in this mode until it is powered down or reset.
+      SingleCycleCommand (SPI_EEPROM_COMMAND_WRITE_ENABLE);
+      SingleCycleCommand (SPI_EEPROM_COMMAND_ENTER_4BYTE_MODE);
+      SingleCycleCommand (SPI_EEPROM_COMMAND_WRITE_DISABLE);
+    }
+  }
+#endif
+  do__not__puthex ((u_int16) (chipBlocks >> 3));
+  do__not__puts ("=4K sectors");
+}
+
+// Returns 1 if the first 4K sector reads back the same as in WORKSPACE
+u_int16 EeVerifyBootSector (void)
+{
+  u_int16 needErase;
+  return !EeCompare4K (0, WORKSPACE, &needErase) && !needErase;
+}
+
+
+struct CachedSector *FindCachedSector (u_int16 lba)
+{
+  register u_int16 h = SECTOR_HASH (lba);
+  register u_int16 n;
+  for (n = 0; n < SECTOR_INDEX_SIZE; n++)
+  {
+    if (!sectorIndex[h].blocks)
+      break;
+    if (sectorIndex[h].lba == lba)
+      return &sectorIndex[h];
+    h = (h + 1) & (SECTOR_INDEX_SIZE - 1);
+  }
+  return NULL;
+}
+
+// Put cache slot i to the sector index
+void IndexCacheSlot (u_int16 i)
+{
+  register u_int16 lba = blockAddress[i] & 0xfff8;
+  register u_int16 k = blockAddress[i] & 7;
+  register struct CachedSector *s = FindCachedSector (lba);
+  if (!s)
+  {
+    register u_int16 h = SECTOR_HASH (lba);
+    while (sectorIndex[h].blocks)
+      h = (h + 1) & (SECTOR_INDEX_SIZE - 1);
+    s = &sectorIndex[h];
+    s->lba = lba;
+  }
+  s->blocks |= 1 << k;
+  s->slot[k >> 2] = (s->slot[k >> 2] & ~(15 << ((k & 3) * 4)))
+    | (i << ((k & 3) * 4));
+}
+
+// Release cache slot i and drop it from the sector index
+void FreeCacheSlot (u_int16 i)
+{
+  register struct CachedSector *s =
+    FindCachedSector (blockAddress[i] & 0xfff8);
+  blockPresent &= ~(1 << i);
+  if (s && !(s->blocks &= ~(1 << (blockAddress[i] & 7))))
+  {
+    // Last block of the sector gone: close the gap in the probe
+    // sequence by moving back entries that can be found earlier.
+    register u_int16 e = s - sectorIndex, j = e;
+    while (1)
+    {
+      j = (j + 1) & (SECTOR_INDEX_SIZE - 1);
+      if (!sectorIndex[j].blocks)
+        break;
+      if (((j - SECTOR_HASH (sectorIndex[j].lba)) & (SECTOR_INDEX_SIZE - 1))
+          >= ((j - e) & (SECTOR_INDEX_SIZE - 1)))
+      {
+        sectorIndex[e] = sectorIndex[j];
+        sectorIndex[j].blocks = 0;
+        e = j;
+      }
+    }
+  }
+}
+
+// Cache slot of block k of a sector
+#define SECTOR_SLOT(s, k) (((s)->slot[(k) >> 2] >> (((k) & 3) * 4)) & 15)
+
+__y u_int16 *FindCachedBlock (u_int16 blockNumber)
+{
+  register struct CachedSector *s = FindCachedSector (blockNumber & 0xfff8);
+  register u_int16 k = blockNumber & 7;
+  lastFoundBlock = -1;
+  if (s && (s->blocks & (1 << k)))
+  {
+    lastFoundBlock = SECTOR_SLOT (s, k);
+    return mallocAreaY + 256 * lastFoundBlock;
+  }
+  return NULL;
+}
+
+
+// Forget all cached blocks of the 4K sector of lba
+void DropCachedSector (u_int16 lba)
+{
+  register struct CachedSector *s = FindCachedSector (lba & 0xfff8);
+  if (s)
+  {
+    struct CachedSector c = *s; /* entry may move as slots are freed */
+    register u_int16 j;
+    for (j = 0; j < 8; j++)
+    {
+      if (c.blocks & (1 << j))
+        FreeCacheSlot (SECTOR_SLOT (&c, j));
+    }
+  }
+}
+
+
+// Merge the cached blocks of the 4K sector at lba with the rest of the
+// sector from flash into WORKSPACE. Sets the pages that need programming
+// and whether the sector needs an erase first, and returns a bitmask of
+// the cache slots that were merged.
+u_int16 MergeSector (u_int16 lba, u_int16 * pages, u_int16 * needErase)
+{
+  register u_int16 j;
+  u_int16 sectorSlots = 0;
+  register struct CachedSector *s = FindCachedSector (lba);
+
+  *pages = *needErase = 0;
+  if (IsSectorFree (lba) && !IsSectorErased (lba))
+  { // old contents don't matter, only that they are not blank
+    *needErase = 1;
+  }
+  sectorFree[SECTOR_WORD (lba)] &= ~SECTOR_BIT (lba);
+  if (s->blocks == 0xff)
+  { // whole sector cached, in whatever slots: compare it in one pass
+    do__not__puthex (lba);
+    do__not__puts (" completes 4K ");
+    for (j = 0; j < 8; j++)
+    {
+      memcpyYY (WORKSPACE + 256 * j, mallocAreaY + 256 * SECTOR_SLOT (s, j),
+                256);
+      sectorSlots |= 1 << SECTOR_SLOT (s, j);
+    }
+    if (IsSectorErased (lba) || *needErase)
+    { // no need to read back what is known to be blank or free
+      *pages = NonBlankPages (WORKSPACE);
+    }
+    else
+    {
+      *pages = EeCompare4K (lba, WORKSPACE, needErase);
+    }
+  }
+  else
+  {
+    if (IsSectorErased (lba) || *needErase)
+    { // nothing to read back, old contents are all blank or free
+      memsetY (WORKSPACE, ERASED_DATA, 2048);
+    }
+    else
+    {
+      EeRead4KSectorYToWorkspace (lba);
+    }
+    for (j = 0; j < 8; j++)
+    {
+      do__not__puthex (lba + j);
+      if (s->blocks & (1 << j))
+      {
+        register u_int16 slot = SECTOR_SLOT (s, j);
+        // decide erase from the copy just read, no second SPI pass
+        *pages |= CompareBlockYY (WORKSPACE + (256 * j),
+                                  mallocAreaY + 256 * slot,
+                                  needErase) << (2 * j);
+        memcpyYY (WORKSPACE + (256 * j), mallocAreaY + 256 * slot, 256);
+        sectorSlots |= 1 << slot;
+
+        do__not__puts ("from cache");
+      }
+      else
+      {
+        do__not__puts ("from disk");
+      }
+    }
+  }
+  if (*needErase)
+  {
+    *pages = NonBlankPages (WORKSPACE);
+  }
+  for (j = 0; j < 8; j++)
+  { // what the flash holds once the write-back is done
+    SetBlockSum (lba + j, BlockSumY (WORKSPACE + 256 * j));
+  }
+  return sectorSlots;
+}
+
+void FreeCacheSlots (u_int16 slots)
+{
+  register u_int16 j;
+  for (j = 0; j < CACHE_BLOCKS; j++)
+  {
+    if (slots & (1 << j))
+      FreeCacheSlot (j);
+  }
+}
+
+// Begin the background write-back of the 4K sector at lba
+void StartWriteBack (u_int16 lba)
+{
+  u_int16 needErase;
+
+  wbSlots = MergeSector (lba, &wbPages, &needErase);
+  wbLba = lba;
+  wbErased = -1;
+  wbEraseBlocks = 8;
+  wbEraseCommand = erase4KCommand;
+  wbState = WB_UNPROTECT;
+  if (needErase || wbPages)
+  {
+    wbErased = !wbPages;
+    SetSectorState (lba, -1);
+  }
+  if (needErase)
+  {
+    wbState = WB_UNPROTECT_ERASE;
+  }
+}
+
+// Issue the next SPI operation of the background write-back if the chip
+// is ready for it. Never waits for the flash.
+void WriteBackStep (void)
+{
+  if (wbState == WB_IDLE)
+    return;
+#if USE_PRE_ERASE
+  if (eraseSuspended)
+  { // the chip is idle only because of FsMapSpiFlashPreEraseSuspend()
+    SingleCycleCommand (eraseResumeCommand);
+    eraseSuspended = 0;
+    return;
+  }
+#endif
+  if (EeBusy ())
+    return;
+
+  switch (wbState)
+  {
+  case WB_UNPROTECT_ERASE:
+    SingleCycleCommand (SPI_EEPROM_COMMAND_WRITE_ENABLE);
+    SingleCycleCommand (SPI_EEPROM_COMMAND_CLEAR_ERROR_FLAGS);
+    EeStartUnprotect ();
+    wbState = WB_ERASE;
+    break;
+
+  case WB_ERASE:
+    SingleCycleCommand (SPI_EEPROM_COMMAND_WRITE_ENABLE);
+    EeStartErase (wbLba, wbEraseCommand);
+    wbState = WB_UNPROTECT;
+    break;
+
+  case WB_UNPROTECT:
+    if (wbPages)
+    {
+      EeStartUnprotect ();
+      wbState = WB_PROGRAM;
+    }
+    else
+    { // all done
+      if (wbErased >= 0)
+        SetSectorState (wbLba, wbErased);
+      wbState = WB_IDLE;
+      FreeCacheSlots (wbSlots);
+      do__not__puthex (wbLba);
+      do__not__puts ("written");
+    }
+    break;
+
+  case WB_PROGRAM:
+    {
+      register u_int16 i = 0;
+      while (!(wbPages & (1 << i)))
+        i++;
+      wbPages &= ~(1 << i);
+      SingleCycleCommand (SPI_EEPROM_COMMAND_WRITE_ENABLE);
+      EeStartPageProgram (wbLba, i, WORKSPACE + 128 * i);
+      wbState = WB_UNPROTECT;
+    }
+    break;
+  }
+}
+
+// Complete the background write-back, waiting for the flash
+s_int16 FinishWriteBack (void)
+{
+  while (wbState != WB_IDLE)
+  {
+    if (SpiWaitStatus () == -1)
+      return -1;  /* USB HAS BEEN RESET */
+    WriteBackStep ();
+  }
+  return 0;
+}
+
+// Begin erasing n blocks at blockn with command in the background. The
+// sectors count as erased from now on, although the status register
+// write before the erase and the erase itself are only sent by later
+// write-back steps. Until the erase has completed, reads of the blocks
+// return erased data without going to the flash, see IN_ERASE().
+void StartErase (u_int16 blockn, u_int16 n, u_int16 command)
+{
+  register u_int16 i;
+  prefetchValid = 0;
+  for (i = 0; i < n; i += 8)
+  {
+    SetSectorState (blockn + i, 1);
+  }
+  wbLba = blockn;
+  wbPages = 0;
+  wbSlots = 0;
+  wbErased = -1;
+  wbEraseBlocks = n;
+  wbEraseCommand = command;
+  wbState = WB_UNPROTECT_ERASE;
+}
+
+// The host has announced a write up to block end (exclusive). If it
+// covers the whole 64K or 32K block of the chip starting at blockn, erase
+// that in the background with one command instead of erasing its 4K
+// sectors one by one as they are written back. Only the WRITE(10) being
+// received is known to follow: a stream of commands that together cover
+// the block may stop at any of them, and the rest of the block must then
+// keep its data. Such a stream gets its 4K sectors erased ahead of the
+// data by EraseNextSector() instead. With RESERVED_BLOCKS at 16K, the
+// 64K commands of a large copy start 16K into a 64K block, so this pays
+// off with a 32K erase, or with a host that sends longer commands.
+void EraseAhead (u_int16 blockn, u_int32 end)
+{
+  register u_int16 i, n;
+  u_int16 command;
+
+  if (!(blockn & 127) && erase64KCommand && end >= blockn + 128L)
+  {
+    n = 128;
+    command = erase64KCommand;
+  }
+  else if (!(blockn & 63) && erase32KCommand && end >= blockn + 64L)
+  {
+    n = 64;
+    command = erase32KCommand;
+  }
+  else
+    return;
+
+  // A blank region is cheaper to read than to erase
+  for (i = 0; i < n; i += 8)
+  {
+    if (!IsSectorErased (blockn + i))
+    {
+      if (FinishWriteBack () == -1)
+        return;  /* USB HAS BEEN RESET */
+      if (!EeIsErased4K (blockn + i))
+        break;
+      SetSectorState (blockn + i, 1);
+    }
+  }
+  if (i == n)
+    return;
+
+  for (i = 0; i < n; i += 8)
+  { // older cached data is about to be overwritten by the host anyway
+    DropCachedSector (blockn + i);
+    sectorFree[SECTOR_WORD (blockn + i)] &= ~SECTOR_BIT (blockn + i);
+  }
+  StartErase (blockn, n, command);
+  do__not__puthex (blockn);
+  do__not__puts ("erase ahead");
+}
+
+// Erase the 4K sector after the blocks the host has sent so far, if the
+// rest of its WRITE(10) covers it, while the blocks before it still
+// arrive. Called when the write-back machinery is idle.
+void EraseNextSector (void)
+{
+  u_int32 next = (hostNext + 7) & ~7L;
+  register u_int16 lba = (u_int16) next;
+
+  if (SCSI.State != SCSI_DATA_FROM_HOST || next + 8 > hostEnd
+      || next + 8 > chipBlocks || IsSectorErased (lba)
+      || FindCachedSector (lba) || EeBusy ())
+    return;
+  if (EeIsErased4K (lba))
+  {
+    SetSectorState (lba, 1);
+  }
+  else
+  {
+    sectorFree[SECTOR_WORD (lba)] &= ~SECTOR_BIT (lba);
+    StartErase (lba, 8, erase4KCommand);
+    do__not__puthex (lba);
+    do__not__puts ("erase next");
+  }
+}
+
+#if USE_FILE_INDEX
+// Read words from word offset offset of the file index sector
+void FsMapSpiFlashReadIndex (u_int16 offset, __y u_int16 * d, u_int16 words)
+{
+  SpiWaitStatus ();
+  EePutReadAddress (FILE_INDEX_BLOCK, offset);
+  while (words--)
+  {
+#if USE_INVERTED_DISK_DATA
+    *d++ = ~SpiSendReceive (0);
+#else
+    *d++ = SpiSendReceive (0);
+#endif
+  }
+  EeEndRead ();
+}
+
+// Returns the first word of the file index sector
+u_int16 FileIndexMagic (void)
+{
+  register u_int16 w;
+  SpiWaitStatus ();
+  EePutReadAddress (FILE_INDEX_BLOCK, 0);
+  w = SpiSendReceive (0);
+  EeEndRead ();
+#if USE_INVERTED_DISK_DATA
+  return ~w;
+#else
+  return w;
+#endif
+}
+
+// Write the file index in WORKSPACE to the file index sector. Only a
+// blank sector or an old index is overwritten, never boot code that has
+// grown into the sector. Returns -1 if not written.
+s_int16 FsMapSpiFlashWriteIndex (void)
+{
+  u_int16 state = WB_UNPROTECT_ERASE;
+
+  FinishWriteBack ();
+  if (FileIndexMagic () != FILE_INDEX_MAGIC)
+  {
+    if (!EeIsErased4K (FILE_INDEX_BLOCK))
+      return -1;
+    state = WB_UNPROTECT;
+  }
+  wbState = state;
+  wbLba = FILE_INDEX_BLOCK;
+  wbPages = NonBlankPages (WORKSPACE);
+  wbSlots = 0;
+  wbErased = 0;
+  wbEraseBlocks = 8;
+  wbEraseCommand = erase4KCommand;
+  FinishWriteBack ();
+  fileIndexDropped = 0;
+  return 0;
+}
+
+// The disk is about to change: erase the file index, so that the player
+// never opens a file through an index that is out of date, even if the
+// power goes before it has been rebuilt.
+void DropFileIndex (void)
+{
+  FinishWriteBack ();
+  if (FileIndexMagic () == FILE_INDEX_MAGIC)
+    StartErase (FILE_INDEX_BLOCK, 8, erase4KCommand);
+  fileIndexDropped = 1;
+}
+#endif /* USE_FILE_INDEX */
+
+// Write back the cached blocks of the 4K sector at lba, merged with the
+// rest of the sector from flash, and free their cache slots. If the USB
+// is reset meanwhile, the sector stays in WORKSPACE as a write-back in
+// progress, so it can still be read and is finished later.
+s_int16 FlushSector (u_int16 lba)
+{
+  StartWriteBack (lba);
+  return FinishWriteBack ();
+}
+
+// Make room in the cache by writing back only the sector that was least
+// recently written to. Sectors the host keeps rewriting stay cached, and
+// FAT and directory sectors are passed over while there are others.
+s_int16 EvictSector (void)
+{
+  register u_int16 i, oldest = 0, age = 0, pinned = 1;
+  for (i = 0; i < SECTOR_INDEX_SIZE; i++)
+  {
+    if (sectorIndex[i].blocks)
+    {
+      register u_int16 p = IS_PINNED (sectorIndex[i].lba)
+        || sectorIndex[i].stamp == cacheClock;
+      if (p <= pinned && (p < pinned || cacheClock - sectorIndex[i].stamp >= age))
+      {
+        age = cacheClock - sectorIndex[i].stamp;
+        oldest = i;
+        pinned = p;
+      }
+    }
+  }
+  do__not__puthex (sectorIndex[oldest].lba);
+  do__not__puts ("=evict");
+  return FlushSector (sectorIndex[oldest].lba);
+}
+
+#define BOOT_BYTE(d, n) (((n) & 1) ? (d)[(n) >> 1] & 0xff : (d)[(n) >> 1] >> 8)
+#define BOOT_WORD(d, n) (BOOT_BYTE (d, n) | (BOOT_BYTE (d, (n) + 1) << 8))
+
+// Find the FAT and root directory area from a FAT12/16 boot sector
+void LearnMetadataArea (u_int16 * d)
+{
+  metaStart = metaEnd = 0;
+  if (d[255] == 0x55aa && BOOT_WORD (d, 11) == 512)
+  {
+    metaStart = RESERVED_BLOCKS + BOOT_WORD (d, 14);
+    metaEnd = metaStart + BOOT_BYTE (d, 16) * BOOT_WORD (d, 22)
+      + (BOOT_WORD (d, 17) >> 4);
+  }
+}
+
+__y u_int16 *GetEmptyBlock (u_int16 blockNumber)
+{
+  register int i;
+  for (i = 0; i < CACHE_BLOCKS; i++)
+  {
+    if (!(blockPresent & 1 /* was L */  << i))
+    {
+      blockPresent |= 1 /* was L */  << i;
+      blockAddress[i] = blockNumber;
+      IndexCacheSlot (i);
+      return mallocAreaY + 256 * i;
+    }
+  }
+  // do__not__puts("cannot allocate empty block");
+  return NULL;
+}
+
+
+
+struct FsMapper spiFlashMapper = {
+  0x010c, /* version */
+  256,  /* blocksize */
+  0,  /* blocks, from the chip size in FsMapSpiFlashCreate() */
+  0,  /* cacheBlocks */
+  FsMapSpiFlashCreate,
+  FsMapFlNullOk,  // RamMapperDelete,
+  FsMapSpiFlashRead,
+  FsMapSpiFlashWrite,
+  FsMapSpiFlashFree,
+  FsMapSpiFlashFlush, // RamMapperFlush,
+  NULL  /* no physical */
+};
+
+// Find the fastest reliable way to read the flash at the current core
+// clock. The boot code sector is read with READ at a slow clock as the
+// reference. The result is the smallest clock divider, from
+// fastestDivider up, at which FAST READ or else READ reads it back the
+// same twice. A divider found at one core clock is safe at any slower
+// core clock.
+void FsMapSpiFlashCalibrate (u_int16 fastestDivider)
+{
+  u_int16 div;
+
+  FinishWriteBack ();
+  memsetY (BLOCK_SUMS, 0, BLOCK_SUM_BLOCKS / 2);
+  usbBuffersInUse = 1;
+  prefetchValid = 0;
+  FsMapSpiFlashForgetFree (); /* the host owns the disk now */
+  InitSpi (SPI_CALIBRATION_DIVIDER);
+  spiReadCommand = readCommand;
+  EeRead4KSectorYToWorkspace (0);
+  if (IsSectorErased (0))
+  { // no boot code to compare with, keep the defaults
+    InitSpi (spiClockDivider);
+    return;
+  }
+  for (div = fastestDivider; div < SPI_CALIBRATION_DIVIDER; div++)
+  {
+    InitSpi (div);
+    spiReadCommand = fastReadCommand;
+    if (fastReadCommand && EeVerifyBootSector () && EeVerifyBootSector ())
+      break;
+    spiReadCommand = readCommand;
+    if (EeVerifyBootSector () && EeVerifyBootSector ())
+      break;
+  }
+  spiClockDivider = div;
+  InitSpi (div);
+  do__not__puthex (spiReadCommand);
+  do__not__puthex (spiClockDivider);
+  do__not__puts ("=read command, divider");
+}
+
+struct FsMapper *FsMapSpiFlashCreate (struct FsPhysical *physical,
+                                      u_int16 cacheSize)
+{
+
+  do__not__puts ("CREATE");
+  InitSpi (SPI_CALIBRATION_DIVIDER);
+  EeIdentify ();
+  spiFlashMapper.blocks = chipBlocks - RESERVED_BLOCKS;
+  blockPresent = 0;
+  memset (sectorIndex, 0, sizeof (sectorIndex));
+  memset (sectorErased, 0, sizeof (sectorErased));
+  metaStart = metaEnd = 0;
+  wbState = WB_IDLE;
+  shouldFlush = 0;
+  FsMapSpiFlashCalibrate (SPI_CLOCK_DIVIDER);
+  usbBuffersInUse = 0;
+  return &spiFlashMapper;
+}
+
+
+
+s_int16 FsMapSpiFlashRead (struct FsMapper * map, u_int32 firstBlock,
+                           u_int16 blocks, u_int16 * data)
+{
+  register s_int16 bl = 0;
+
+  // Reads are served during a flush too: blocks of the sector being
+  // written back from WORKSPACE, other cached blocks from the cache,
+  // blocks of a background erase as erased, the rest from flash, which
+  // then holds their latest data.
+  firstBlock += RESERVED_BLOCKS;
+
+  while (bl < blocks)
+  {
+    __y u_int16 *source;
+    if (IN_WRITE_BACK (firstBlock))
+    { // being written back, the flash copy may be half erased
+      source = WORKSPACE + 256 * (firstBlock & 7);
+    }
+    else
+    {
+      source = FindCachedBlock (firstBlock);
+      if (!source && prefetchValid && firstBlock == prefetchBlock
+          && usbBuffersInUse)
+      {
+        PrefetchWords (256);
+        source = PREFETCH;
+      }
+    }
+#if 0
+    do__not__puthex (firstBlock);
+    do__not__puthex ((u_int16) source);
+    do__not__puts ("=rd_lba, addr");
+#endif
+    if (source)
+    {
+      memcpyYX (data, source, 256);
+    }
+    else if (IN_ERASE (firstBlock))
+    { // the flash may still hold the old data
+      register u_int16 i;
+      for (i = 0; i < 256; i++)
+      {
+        data[i] = ERASED_DATA;
+      }
+    }
+    else
+    {
+      EeReadBlock (firstBlock, data);
+      // memset(data, 0, 256);
+    }
+    if (firstBlock == RESERVED_BLOCKS)
+    {
+      LearnMetadataArea (data);
+    }
+    data += 256;
+    firstBlock++;
+    bl++;
+  }
+  hostReadNext = firstBlock;
+  return bl;
+}
+
+
+s_int16 FsMapSpiFlashWrite (struct FsMapper * map, u_int32 firstBlock,
+                            u_int16 blocks, u_int16 * data)
+{
+  s_int16 bl = 0;
+
+  // During a host WRITE(10) the rest of the command is known to follow.
+  // Count the current blocks in BlocksLeftToReceive, so that the end is
+  // never overestimated whether or not the ROM has already subtracted
+  // them.
+  hostEnd = firstBlock + blocks;
+  if (SCSI.State == SCSI_DATA_FROM_HOST
+      && (SCSI.CurrentDiskSector == firstBlock
+          || SCSI.CurrentDiskSector == firstBlock + blocks)
+      && SCSI.BlocksLeftToReceive > blocks)
+  {
+    hostEnd = firstBlock + SCSI.BlocksLeftToReceive;
+  }
+  firstBlock += RESERVED_BLOCKS;
+  hostEnd += RESERVED_BLOCKS;
+  hostNext = firstBlock + blocks;
+  prefetchValid = 0;
+
+  if (shouldFlush)
+  {
+    do__not__puts ("flush-reject");
+    return 0; // don't accept write while flushing
+  }
+  lastWriteTime = ReadTimeCount ();
+#if USE_FILE_INDEX
+  if (!fileIndexDropped)
+  {
+    DropFileIndex ();
+  }
+#endif
+  while (bl < blocks)
+  {
+    __y u_int16 *target;
+
+    if (firstBlock == RESERVED_BLOCKS)
+    {
+      LearnMetadataArea (data);
+    }
+    // The host uses the sector now, whether or not the block changes
+    sectorFree[SECTOR_WORD (firstBlock)] &= ~SECTOR_BIT (firstBlock);
+
+    if (!(firstBlock & 63))
+    {
+      EraseAhead (firstBlock, hostEnd);
+    }
+
+    // The cache slots of a sector being written back are about to be
+    // freed: let the write-back finish before the sector changes again.
+    if (IN_WRITE_BACK (firstBlock) && FinishWriteBack () == -1)
+    {
+      shouldFlush = 1;
+      return bl;  /* USB HAS BEEN RESET */
+    }
+
+    // Is the block to be written different than data already in EEPROM?
+    // A cached block is always rewritten, the flash copy is older.
+    target = FindCachedBlock (firstBlock);
+    if (target || (IsSectorErased (firstBlock) ? !IsBlankData (data, 256)
+                   : BlockDiffers (firstBlock, data)))
+    {
+      if (target)
+      {
+        do__not__puthex (firstBlock);
+        do__not__puthex ((u_int16) target);
+        do__not__puts ("=rewrite_lba");
+      }
+      else
+      {
+        target = GetEmptyBlock (firstBlock);
+        do__not__puthex (firstBlock);
+        do__not__puts ("=write_lba");
+      }
+      if (!target && wbState != WB_IDLE)
+      { // cache is full, the write-back in progress frees some
+        if (FinishWriteBack () == -1)
+        {
+          shouldFlush = 1;
+          return bl;  /* USB HAS BEEN RESET */
+        }
+        target = GetEmptyBlock (firstBlock);
+      }
+      if (!target)
+      { // cache is full
+        // must write back a sector to get cache space
+        if (EvictSector () == -1)
+        {
+          shouldFlush = 1;
+          return bl;  /* USB HAS BEEN RESET */
+        }
+        target = GetEmptyBlock (firstBlock);
+      }
+      if (target)
+      {
+        memcpyXY (target, data, 256);
+        FindCachedSector (firstBlock & 0xfff8)->stamp = ++cacheClock;
+        PrintCache ();
+      }
+      else
+      {
+        puts ("FATAL ERROR: NO CACHE SPACE. THIS NEVER HAPPENS.");
+        while (1)
+          ;
+      }
+    }
+    else
+    {
+      do__not__puthex (firstBlock);
+      do__not__puts ("=lba; Redundant write skipped");
+    }
+
+    if (PERIP (USB_STATUS) & USB_STF_BUS_RESET)
+    {
+      do__not__puts ("USB: Reset");
+    };
+    data += 256;
+    firstBlock++;
+    bl++;
+  }
+  return bl;
+}
+
+// The file system no longer uses the blocks. Whole 4K sectors among them
+// are dropped from the cache and marked free; the erase is left to
+// FsMapSpiFlashPreErase() once the whole free space is known.
+s_int16 FsMapSpiFlashFree (struct FsMapper * map, u_int32 firstBlock,
+                           u_int32 blocks)
+{
+  u_int32 end;
+
+  firstBlock += RESERVED_BLOCKS;
+  end = (firstBlock + blocks) & ~7L;
+  firstBlock = (firstBlock + 7) & ~7L;
+  if (end > chipBlocks)
+    end = chipBlocks;
+  while (firstBlock < end)
+  {
+    if (IN_WRITE_BACK (firstBlock) && FinishWriteBack () == -1)
+      return -1;  /* USB HAS BEEN RESET */
+    DropCachedSector (firstBlock);
+    sectorFree[SECTOR_WORD (firstBlock)] |= SECTOR_BIT (firstBlock);
+    firstBlock += 8;
+  }
+  return 0;
+}
+
+// The free space of the whole disk has been reported through
+// FsMapSpiFlashFree() since FsMapSpiFlashForgetFree(): the free map is
+// of the current FAT, so FsMapSpiFlashPreErase() may erase by it.
+void FsMapSpiFlashFreeDone (void)
+{
+  preEraseNext = 0;
+}
+
+// Forget which sectors are free, before the free space of the disk is
+// walked again and when the host may change the file system
+void FsMapSpiFlashForgetFree (void)
+{
+  memset (sectorFree, 0, sizeof (sectorFree));
+  preEraseNext = chipBlocks;
+}
+
+#if USE_PRE_ERASE
+// Erase one free sector that is not known to be erased, without waiting
+// for the flash. Returns non-zero while there is work left, call again.
+// Does nothing until FsMapSpiFlashFreeDone(). An erase suspended by
+// FsMapSpiFlashPreEraseSuspend() is resumed first.
+u_int16 FsMapSpiFlashPreErase (void)
+{
+  if (wbState != WB_IDLE)
+  {
+    WriteBackStep ();
+    return 1;
+  }
+  while (preEraseNext < chipBlocks)
+  {
+    register u_int16 blockn = preEraseNext;
+    if (IsSectorFree (blockn) && !IsSectorErased (blockn))
+    {
+      if (EeBusy ())
+        return 1;
+      // A blank sector is cheaper to read than to erase
+      if (EeIsErased4K (blockn))
+        SetSectorState (blockn, 1);
+      else
+        StartErase (blockn, 8, erase4KCommand);
+      preEraseNext += 8;
+      return 1;
+    }
+    preEraseNext += 8;
+  }
+  return 0;
+}
+
+// A file is about to be opened: keep the pre-erase from holding off its
+// reads for the erase time of the chip. An erase the chip is busy with
+// is suspended if the chip has an erase suspend command, and resumed by
+// the next FsMapSpiFlashPreErase() or write-back step. An erase not yet
+// sent waits there too, as the player never reads free sectors; the
+// status register write before it can't be suspended.
+void FsMapSpiFlashPreEraseSuspend (void)
+{
+  if (wbState == WB_UNPROTECT && !wbPages && !eraseSuspended
+      && eraseSuspendCommand && EeBusy ())
+  {
+    SingleCycleCommand (eraseSuspendCommand);
+    eraseSuspended = 1;
+  }
+}
+#endif /* USE_PRE_ERASE */
+
+s_int16 FsMapSpiFlashFlush (struct FsMapper * map, u_int16 hard)
+{
+  u_int16 i;
+
+  do__not__puts ("FLUSH");
+  PrintCache ();
+  EeEndRead ();
+
+  if (shouldFlush > 1)
+    return 0;
+  shouldFlush = 2;  // flushing
+
+  if (-1 == FinishWriteBack ())
+  {
+    shouldFlush = 1;
+    return 0; /* USB HAS BEEN RESET */
+  }
+  for (i = 0; i < CACHE_BLOCKS; i++)
+  {
+    if (blockPresent & (1 /* was L */  << i))
+    {
+      do__not__puthex (i);
+      do__not__puthex (blockAddress[i]);
+      do__not__puts ("slot, lba  is dirty");
+      if (-1 == FlushSector (blockAddress[i] & 0xfff8))
+      {
+        shouldFlush = 1;
+        return 0; /* USB HAS BEEN RESET */
+      }
+    }
+  }
+  shouldFlush = 0;
+  return 0;
+
+}
+
+// While the ROM sends a block of a host READ(10) to the host, read the
+// next one from flash into PREFETCH, a packet's worth of words per call
+// on the READ command left open, so that its Read() is only a copy.
+// Returns 1 if it read something.
+u_int16 PrefetchNextBlock (void)
+{
+  u_int32 next = hostReadNext;
+  register u_int16 blockn = (u_int16) next;
+
+  if (!usbBuffersInUse || !SCSI.BlocksLeftToSend)
+    return 0;
+  if (!prefetchValid || next != prefetchBlock)
+  {
+    if (next >= chipBlocks || IN_WRITE_BACK (blockn) || IN_ERASE (blockn)
+        || FindCachedBlock (blockn))
+      return 0;
+    prefetchBlock = blockn;
+    prefetchValid = 1;
+    prefetchWords = 0;
+  }
+  if (prefetchWords == 256)
+    return 0;
+  PrefetchWords (32);
+  return 1;
+}
+
+// Called from the USB loop after every USBHandler() call. Advances the
+// background write-back by at most one SPI operation, or starts writing
+// back the next sector: a complete 4K sector as soon as it is cached,
+// others, and FAT and directory sectors even when complete, once the
+// host has stopped writing for WRITE_BACK_DELAY, so a burst of file
+// copies costs one write of the FAT and directory sectors instead of
+// one per file.
+void FsMapSpiFlashStep (void)
+{
+  register u_int16 i, quiet;
+
+  if (shouldFlush)
+    return;
+  if (wbState != WB_IDLE)
+  {
+    WriteBackStep ();
+    return;
+  }
+  if (PrefetchNextBlock ())
+    return;
+  quiet = ReadTimeCount () - lastWriteTime > WRITE_BACK_DELAY;
+  for (i = 0; blockPresent && i < SECTOR_INDEX_SIZE; i++)
+  {
+    if (quiet ? sectorIndex[i].blocks != 0
+        : sectorIndex[i].blocks == 0xff && !IS_PINNED (sectorIndex[i].lba))
+    {
+      StartWriteBack (sectorIndex[i].lba);
+      return;
+    }
+  }
+  EraseNextSector ();
+}
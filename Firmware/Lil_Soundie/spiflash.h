@@ -0,0 +1,112 @@
+/// \file spiflash.h SPI flash logical disk mapper with 4K sector RAM cache
+#ifndef __SPIFLASH_H__
+#define __SPIFLASH_H__
+
+// The number of 512-byte blocks in the SPI Flash chip if the chip does
+// not tell its size in its SFDP tables or JEDEC ID
+#define CHIP_TOTAL_BLOCKS 1024 /* 1024 * 512 bytes = 512KB (ADESTO AT25SF041) */
+
+// Largest number of 512-byte blocks used on a bigger chip. Sizes the
+// sector erase map, one bit per 4K. At most 65536 (32 MB); above 16 MB
+// the 4-byte address commands are used, and only built in then.
+#ifndef MAX_CHIP_BLOCKS
+#define MAX_CHIP_BLOCKS 16384 /* 8 MB */
+#endif
+
+// Set aside some blocks for VS1000 boot code (and optional parameter data)
+#define RESERVED_BLOCKS 32
+
+// The last 4K sector of the reserved area holds the player's file index,
+// see fileindex.c, so the boot code must end before it. The mapper only
+// writes the sector if it is blank or holds an index, and erases the
+// index when the host first writes to the disk.
+#define FILE_INDEX_BLOCK (RESERVED_BLOCKS - 8)
+#define FILE_INDEX_MAGIC 0x4649 /* "FI" */
+
+#define PRINT_VS3EMU_DEBUG_MESSAGES 0
+
+// SPI clock divider at boot. USB mode calibrates a faster one if the
+// chip reads back reliably.
+#define SPI_CLOCK_DIVIDER 2
+
+// number of 512-blocks in RAM cache (MUST BE 16 DO NOT ALTER! I MEAN IT!)
+#define CACHE_BLOCKS 16
+
+// Position of workspace in Y ram, do not change.
+#define WORKSPACE (mallocAreaY + 6144)
+
+// Table of 8-bit block checksums in Y ram between the cache and the
+// workspace, one byte for each of the first BLOCK_SUM_BLOCKS blocks of
+// the chip. Only used in USB mode, the player needs the memory.
+#define BLOCK_SUMS (mallocAreaY + 4096)
+#define BLOCK_SUM_BLOCKS 4096
+
+// Read-ahead block of a host READ(10) in Y ram after the workspace,
+// also only used in USB mode.
+#define PREFETCH (mallocAreaY + 8192)
+
+// storing the disk data inverted is optimal for the system.
+// storing the disk data uninverted (as is) makes it easier to debug the SPI image
+#define USE_INVERTED_DISK_DATA 1
+
+#ifdef ASM
+
+#else /*ASM*/
+#include <vstypes.h>
+#include <mapper.h>
+
+/* cache info */
+extern u_int16 blockPresent;
+extern u_int16 blockAddress[CACHE_BLOCKS];
+extern s_int16 lastFoundBlock;
+extern u_int16 shouldFlush;
+extern u_int16 usbBuffersInUse;
+
+/* read mode, see FsMapSpiFlashCalibrate() */
+extern u_int16 spiReadCommand;
+extern u_int16 spiClockDivider;
+
+/* chip geometry, see EeIdentify() */
+extern u_int32 chipBlocks;
+extern u_int16 readCommand, fastReadCommand, programCommand;
+extern u_int16 erase4KCommand, erase32KCommand, erase64KCommand;
+extern u_int16 eraseSuspendCommand, eraseResumeCommand;
+extern u_int16 use4ByteAddress;
+
+extern struct FsMapper spiFlashMapper;
+
+struct FsMapper *FsMapSpiFlashCreate (struct FsPhysical *physical,
+                                      u_int16 cacheSize);
+s_int16 FsMapSpiFlashRead (struct FsMapper *map, u_int32 firstBlock,
+                           u_int16 blocks, u_int16 * data);
+s_int16 FsMapSpiFlashWrite (struct FsMapper *map, u_int32 firstBlock,
+                            u_int16 blocks, u_int16 * data);
+s_int16 FsMapSpiFlashFree (struct FsMapper *map, u_int32 firstBlock,
+                           u_int32 blocks);
+s_int16 FsMapSpiFlashFlush (struct FsMapper *map, u_int16 hard);
+void FsMapSpiFlashForgetFree (void);
+void FsMapSpiFlashFreeDone (void);
+u_int16 FsMapSpiFlashPreErase (void);
+void FsMapSpiFlashPreEraseSuspend (void);
+void FsMapSpiFlashReadIndex (u_int16 offset, __y u_int16 * d, u_int16 words);
+s_int16 FsMapSpiFlashWriteIndex (void);
+void FsMapSpiFlashStep (void);
+void FsMapSpiFlashCalibrate (u_int16 fastestDivider);
+
+// Do we want to get debug screen output? It's available if the code
+// is loaded with vs3emu (build script) with RS-232 cable.
+
+#if PRINT_VS3EMU_DEBUG_MESSAGES
+void puthex (u_int16 a);
+void PrintCache ();
+#define do__not__puts(x) puts(x)
+#define do__not__puthex(x) puthex(x)
+#else
+#define do__not__puts(a)
+#define do__not__puthex(a)
+#define PrintCache()
+#endif
+
+#endif /* elseASM */
+
+#endif /* !__SPIFLASH_H__ */
@@ -24,6 +24,18 @@ Measured performance: 1 megabyte file was written in 55 seconds when
 the eeprom was blank (no need to erase). When writing over already
 written data, writing the same file took 1 minute 35 seconds.
 
+The disk mapper is in spiflash.c. hostsim/spisim.c runs it on a PC
+against a simulated SPI flash and reports erase and program counts and
+modeled write time per megabyte for a set of standard workloads. Run it
+before and after every change to the mapper.
+
+The last 4K of the reserved flash area holds an index of the playable
+files (fileindex.c), so that a trigger opens its file without scanning
+the directory, and a boot with an unchanged disk does not count the
+files again. It is rebuilt after a USB session that wrote to the disk.
+Between files, sectorcache.c keeps the FAT and directory sectors that
+minifat reads in otherwise idle Y RAM.
+
 Builds with vskit133 build script (BUILD SPIUSB)
 eeprom.img can be then prommed to the eeprom for bootable system.
 Then you can use your development board to make a master EEPROM image,
@@ -60,29 +72,6 @@ the root directory.
 */
 
 
-
-// The number of 512-byte blocks totally available in the SPI Flash chip
-#define CHIP_TOTAL_BLOCKS 1024 /* 1024 * 512 bytes = 5Kb (ADESTO AT25SF041) */
-
-// Set aside some blocks for VS1000 boot code (and optional parameter data)
-#define RESERVED_BLOCKS 32
-
-#define LOGICAL_DISK_BLOCKS  (CHIP_TOTAL_BLOCKS-RESERVED_BLOCKS)
-
-#define PRINT_VS3EMU_DEBUG_MESSAGES 0
-
-#define SPI_CLOCK_DIVIDER 2
-
-// number of 512-blocks in RAM cache (MUST BE 16 DO NOT ALTER! I MEAN IT!)
-#define CACHE_BLOCKS 16
-
-// Position of workspace in Y ram, do not change.
-#define WORKSPACE (mallocAreaY + 6144)
-
-// storing the disk data inverted is optimal for the system.
-// storing the disk data uninverted (as is) makes it easier to debug the SPI image
-#define USE_INVERTED_DISK_DATA 1
-
 #include <stdio.h>  // Standard io
 #include <stdlib.h> // VS_DSP Standard Library
 #include <vs1000.h> // VS1000B register definitions
@@ -99,6 +88,9 @@ the root directory.
 
 #include "system.h"
 #include "gpioctrl.h"
+#include "spiflash.h"
+#include "fileindex.h"
+#include "sectorcache.h"
 
 #if USE_WAV
 #define PLAYFILE PlayWavOrOggFile
@@ -204,591 +196,19 @@ extern struct Codec *cod;
 extern struct CodecServices cs;
 extern u_int16 codecVorbis[];
 
-/* cache info */
-u_int16 blockPresent;
-u_int16 blockAddress[CACHE_BLOCKS];
-s_int16 lastFoundBlock = -1;
-u_int16 shouldFlush = 0;
-
 enum CodecError PlayWavOrOggFile (void);
-
-// Do we want to get debug screen output? It's available if the code
-// is loaded with vs3emu (build script) with RS-232 cable.
-
-#if PRINT_VS3EMU_DEBUG_MESSAGES
-__y const char hex[] = "0123456789abcdef";
-void puthex (u_int16 a)
-{
-  char tmp[6];
-  tmp[0] = hex[(a >> 12) & 15];
-  tmp[1] = hex[(a >> 8) & 15];
-  tmp[2] = hex[(a >> 4) & 15];
-  tmp[3] = hex[(a >> 0) & 15];
-  tmp[4] = ' ';
-  tmp[5] = '\0';
-  fputs (tmp, stdout);
-}
-
-void PrintCache ()
-{
-  register u_int16 i;
-  for (i = 0; i < CACHE_BLOCKS; i++)
-  {
-    if (blockPresent & 1 << i)
-    {
-      puthex (blockAddress[i]);
-    }
-    else
-    {
-      fputs ("- ", stdout);
-    }
-  }
-  puts ("=cache");
-}
-
-#define do__not__puts(x) puts(x)
-#define do__not__puthex(x) puthex(x)
-#else
-#define do__not__puts(a)
-#define do__not__puthex(a)
-#define PrintCache()
-#endif
-
-#define SPI_EEPROM_COMMAND_WRITE_ENABLE  0x06
-#define SPI_EEPROM_COMMAND_WRITE_DISABLE  0x04
-#define SPI_EEPROM_COMMAND_READ_STATUS_REGISTER  0x05
-#define SPI_EEPROM_COMMAND_WRITE_STATUS_REGISTER  0x01
-#define SPI_EEPROM_COMMAND_READ  0x03
-#define SPI_EEPROM_COMMAND_WRITE 0x02
-#define SPI_EEPROM_COMMAND_CLEAR_ERROR_FLAGS 0x30
-#define SPI_EEPROM_COMMAND_ERASE_BLOCK 0xD8
-#define SPI_EEPROM_COMMAND_ERASE_SECTOR 0x20
-#define SPI_EEPROM_COMMAND_ERASE_CHIP 0xC7
-
-//macro to set SPI to MASTER; 8BIT; FSYNC Idle => xCS high
-#define SPI_MASTER_8BIT_CSHI   PERIP(SPI0_CONFIG) = \
-                                                    SPI_CF_MASTER | SPI_CF_DLEN8 | SPI_CF_FSIDLE1
-
-//macro to set SPI to MASTER; 8BIT; FSYNC not Idle => xCS low
-#define SPI_MASTER_8BIT_CSLO   PERIP(SPI0_CONFIG) = \
-                                                    SPI_CF_MASTER | SPI_CF_DLEN8 | SPI_CF_FSIDLE0
-
-//macro to set SPI to MASTER; 16BIT; FSYNC not Idle => xCS low
-#define SPI_MASTER_16BIT_CSLO  PERIP(SPI0_CONFIG) = \
-                                                    SPI_CF_MASTER | SPI_CF_DLEN16 | SPI_CF_FSIDLE0
-
-void SingleCycleCommand (u_int16 cmd)
-{
-  SPI_MASTER_8BIT_CSHI;
-  SPI_MASTER_8BIT_CSLO;
-  SpiSendReceive (cmd);
-  SPI_MASTER_8BIT_CSHI;
-}
-
-/// Wait for not_busy (status[0] = 0) and return status
-u_int16 SpiWaitStatus (void)
-{
-  u_int16 status;
-  SPI_MASTER_8BIT_CSHI;
-  SPI_MASTER_8BIT_CSLO;
-  SpiSendReceive (SPI_EEPROM_COMMAND_READ_STATUS_REGISTER);
-  do
-  {
-    status = SpiSendReceive (0);
-    if (PERIP (USB_STATUS) & USB_STF_BUS_RESET)
-    {
-      USBHandler ();
-      SPI_MASTER_8BIT_CSHI;
-      return -1;  /* USB HAS BEEN RESET */
-    }
-  }
-  while (status & 0x01);
-  ; // Wait until chip is ready or return -1 if USB bus reset
-
-  SPI_MASTER_8BIT_CSHI;
-
-  return status;
-}
-
-
-void EeUnprotect ()
-{
-  SingleCycleCommand (SPI_EEPROM_COMMAND_WRITE_ENABLE);
-  SPI_MASTER_8BIT_CSLO;
-  SpiSendReceive (SPI_EEPROM_COMMAND_WRITE_STATUS_REGISTER);
-  SpiSendReceive (0x02);  // Sector Protections Off
-  SPI_MASTER_8BIT_CSHI;
-  SpiWaitStatus ();
-  SingleCycleCommand (SPI_EEPROM_COMMAND_WRITE_ENABLE);
-}
-
-void EePutReadBlockAddress (register u_int16 blockn)
-{
-  SPI_MASTER_8BIT_CSLO;
-  SpiSendReceive (SPI_EEPROM_COMMAND_READ);
-  SpiSendReceive (blockn >> 7); // Address[23:16] = blockn[14:7]
-  SpiSendReceive ((blockn << 1) & 0xff);  // Address[15:8] = blockn[6:0]0
-  SpiSendReceive (0); // Address[7:0] = 00000000
-  SPI_MASTER_16BIT_CSLO;
-}
-
-// Check is a 4K block completely blank
-u_int16 EeIsBlockErased (u_int16 blockn)
-{
-  SpiWaitStatus ();
-  EePutReadBlockAddress (blockn);
-  {
-    register u_int16 n;
-    for (n = 0; n < 2048; n++)
-    {
-      if (SpiSendReceive (0) != 0xffff)
-      {
-        SPI_MASTER_8BIT_CSHI;
-        return 0;
-      }
-    }
-    SPI_MASTER_8BIT_CSHI;
-    return 1;
-  }
-}
-
-s_int16 EeProgram4K (u_int16 blockn, __y u_int16 * dptr)
-{
-
-  PERIP (USB_EP_ST3) |= (0x0001); // Force NAK on EP3 (perhaps not needed?)
-
-  do__not__puthex (blockn);
-  do__not__puts ("= write 4K");
-
-  if (!EeIsBlockErased (blockn))
-  { // don't erase if not needed
-    // Erase 4K sector
-    SingleCycleCommand (SPI_EEPROM_COMMAND_WRITE_ENABLE);
-    SingleCycleCommand (SPI_EEPROM_COMMAND_CLEAR_ERROR_FLAGS);
-    EeUnprotect ();
-    SPI_MASTER_8BIT_CSLO;
-    SpiSendReceive (SPI_EEPROM_COMMAND_ERASE_SECTOR);
-    SpiSendReceive (blockn >> 7); // Address[23:16] = blockn[14:7]
-    SpiSendReceive ((blockn << 1) & 0xff);  // Address[15:8] = blockn[6:0]0
-    SpiSendReceive (0); // Address[7:0] = 00000000
-    SPI_MASTER_8BIT_CSHI;
-  }
-
-  if (SpiWaitStatus () == -1)
-    return -1;  /* USB HAS BEEN RESET */
-  // Write 8 512-byte sectors
-  {
-    u_int16 i;
-    for (i = 0; i < 8; i++)
-    {
-
-      // Put first page (256 bytes) of sector.
-      EeUnprotect ();
-      SPI_MASTER_8BIT_CSLO;
-      SpiSendReceive (SPI_EEPROM_COMMAND_WRITE);
-      SpiSendReceive (blockn >> 7); // Address[23:16] = blockn[14:7]
-      SpiSendReceive ((blockn << 1) & 0xff);  // Address[15:8] = blockn[6:0]0
-      SpiSendReceive (0); // Address[7:0] = 00000000
-      SPI_MASTER_16BIT_CSLO;
-      {
-        u_int16 n;
-        for (n = 0; n < 128; n++)
-        {
-#if USE_INVERTED_DISK_DATA
-          SpiSendReceive (~(*dptr++));
-#else
-          SpiSendReceive ((*dptr++));
-#endif
-        }
-      }
-      SPI_MASTER_8BIT_CSHI;
-      if (SpiWaitStatus () == -1)
-        return -1;  /* USB HAS BEEN RESET */
-
-      // Put second page (256 bytes) of sector.
-      EeUnprotect ();
-      SPI_MASTER_8BIT_CSLO;
-      SpiSendReceive (SPI_EEPROM_COMMAND_WRITE);
-      SpiSendReceive (blockn >> 7); // Address[23:16] = blockn[14:7]
-      SpiSendReceive (((blockn << 1) + 1) & 0xff);  // Address[15:8] =
-      // blockn[6:0]1
-      SpiSendReceive (0); // Address[7:0] = 00000000
-      SPI_MASTER_16BIT_CSLO;
-      {
-        u_int16 n;
-        for (n = 0; n < 128; n++)
-        {
-#if USE_INVERTED_DISK_DATA
-          SpiSendReceive (~(*dptr++));
-#else
-          SpiSendReceive ((*dptr++));
-#endif
-        }
-      }
-      SPI_MASTER_8BIT_CSHI;
-      if (SpiWaitStatus () == -1)
-        return -1;  /* USB HAS BEEN RESET */
-      blockn++;
-    }
-  }
-  do__not__puts ("written");
-
-  PERIP (USB_EP_ST3) &= ~(0x0001);  // Un-Force NAK on EP3
-  return 0;
-
-}
-
-
-
-// Block Read for SPI EEPROMS with 24-bit address e.g. up to 16MB
-u_int16 EeReadBlock (u_int16 blockn, u_int16 * dptr)
-{
-  SpiWaitStatus ();
-
-  EePutReadBlockAddress (blockn);
-  {
-    int n;
-    for (n = 0; n < 256; n++)
-    {
-#if USE_INVERTED_DISK_DATA
-      *dptr++ = ~SpiSendReceive (0);
-#else
-      *dptr++ = SpiSendReceive (0);
-#endif
-    }
-  }
-  SPI_MASTER_8BIT_CSHI;
-  return 0;
-}
-
-// Returns 1 if block differs from data, 0 if block is the same
-u_int16 EeCompareBlock (u_int16 blockn, u_int16 * dptr)
-{
-  SpiWaitStatus ();
-
-  EePutReadBlockAddress (blockn);
-  {
-    int n;
-    for (n = 0; n < 256; n++)
-    {
-
-#if USE_INVERTED_DISK_DATA
-      if ((*dptr++) != (~SpiSendReceive (0)))
-#else
-      if ((*dptr++) != (SpiSendReceive (0)))
-#endif
-      {
-        SPI_MASTER_8BIT_CSHI;
-        return 1;
-      }
-    }
-  }
-  SPI_MASTER_8BIT_CSHI;
-  return 0;
-}
-
-u_int16 EeRead4KSectorYToWorkspace (u_int16 blockn)
-{
-  register __y u_int16 *dptr;
-  dptr = WORKSPACE;
-  SpiWaitStatus ();
-  blockn &= 0xfff8; // always point to first block of 4k sector
-
-
-  EePutReadBlockAddress (blockn);
-  {
-    int n;
-    for (n = 0; n < 2048; n++)
-    {
-#if USE_INVERTED_DISK_DATA
-      *dptr++ = ~SpiSendReceive (0);
-#else
-      *dptr++ = SpiSendReceive (0);
-#endif
-    }
-  }
-  SPI_MASTER_8BIT_CSHI;
-  return 0;
-}
-
-void InitSpi (u_int16 clockDivider)
-{
-  SPI_MASTER_8BIT_CSHI;
-  PERIP (SPI0_FSYNC) = 0;
-  PERIP (SPI0_CLKCONFIG) = SPI_CC_CLKDIV * (clockDivider - 1);
-  PERIP (GPIO1_MODE) |= 0x1f; /* enable SPI pins */
-}
-
-
-__y u_int16 *FindCachedBlock (u_int16 blockNumber)
-{
-  register int i;
-  lastFoundBlock = -1;
-  for (i = 0; i < CACHE_BLOCKS; i++)
-  {
-    if ((blockPresent & 1 /* was L */  << i)
-        && (blockAddress[i] == blockNumber))
-    {
-      lastFoundBlock = i;
-      return mallocAreaY + 256 * i;
-    }
-  }
-  return NULL;
-}
-
-
-u_int16 WriteContinuous4K ()
-{
-  u_int16 i, k;
-  for (i = 0; i < CACHE_BLOCKS - 7; i++)
-  { // for all cached blocks...
-    if ((blockPresent & 1 /* was L */  << i)
-        && ((blockAddress[i] & 0x0007) == 0))
-    {
-      // cached block i contains first 512 of 4K
-      for (k = 1; k < 8; k++)
-      {
-        if (blockAddress[i + k] != blockAddress[i] + k)
-          goto ohi;
-      }
-      do__not__puthex (blockAddress[i]);
-      do__not__puts (" starts continuous 4K ");
-
-      if (-1 != EeProgram4K (blockAddress[i], mallocAreaY + 256 * i))
-      {
-        for (k = 0; k < 8; k++)
-        {
-          blockPresent &= ~(1 /* was L */  << (i + k));
-        }
-      }
-      else
-      {
-        return 0; /* USB HAS BEEN RESET */
-      }
-      return 1;
-    }
-  ohi:
-    {
-    }
-  }
-  return 0;
-}
-
-__y u_int16 *GetEmptyBlock (u_int16 blockNumber)
-{
-  register int i;
-  for (i = 0; i < CACHE_BLOCKS; i++)
-  {
-    if (!(blockPresent & 1 /* was L */  << i))
-    {
-      blockPresent |= 1 /* was L */  << i;
-      blockAddress[i] = blockNumber;
-      return mallocAreaY + 256 * i;
-    }
-  }
-  // do__not__puts("cannot allocate empty block");
-  return NULL;
-}
-
-
-
-struct FsMapper *FsMapSpiFlashCreate (struct FsPhysical *physical,
-                                      u_int16 cacheSize);
-s_int16 FsMapSpiFlashRead (struct FsMapper *map, u_int32 firstBlock,
-                           u_int16 blocks, u_int16 * data);
-s_int16 FsMapSpiFlashWrite (struct FsMapper *map, u_int32 firstBlock,
-                            u_int16 blocks, u_int16 * data);
-s_int16 FsMapSpiFlashFlush (struct FsMapper *map, u_int16 hard);
-
-
-const struct FsMapper spiFlashMapper = {
-  0x010c, /* version */
-  256,  /* blocksize */
-  LOGICAL_DISK_BLOCKS,  /* blocks */
-  0,  /* cacheBlocks */
-  FsMapSpiFlashCreate,
-  FsMapFlNullOk,  // RamMapperDelete,
-  FsMapSpiFlashRead,
-  FsMapSpiFlashWrite,
-  NULL, // FsMapFlNullOk,//RamMapperFree,
-  FsMapSpiFlashFlush, // RamMapperFlush,
-  NULL  /* no physical */
-};
-
-struct FsMapper *FsMapSpiFlashCreate (struct FsPhysical *physical,
-                                      u_int16 cacheSize)
-{
-
-  do__not__puts ("CREATE");
-  InitSpi (SPI_CLOCK_DIVIDER);
-  blockPresent = 0;
-  shouldFlush = 0;
-  return &spiFlashMapper;
-}
-
-
-
-s_int16 FsMapSpiFlashRead (struct FsMapper * map, u_int32 firstBlock,
-                           u_int16 blocks, u_int16 * data)
-{
-  register s_int16 bl = 0;
-
-  if (shouldFlush)
-    return 0;
-  firstBlock += RESERVED_BLOCKS;
-
-  while (bl < blocks)
-  {
-    __y u_int16 *source = FindCachedBlock (firstBlock);
-#if 0
-    do__not__puthex (firstBlock);
-    do__not__puthex ((u_int16) source);
-    do__not__puts ("=rd_lba, addr");
+#ifdef GAPLESS
+void VorbisSetupForget (void);
 #endif
-    if (source)
-    {
-      memcpyYX (data, source, 256);
-    }
-    else
-    {
-      EeReadBlock (firstBlock, data);
-      // memset(data, 0, 256);
-    }
-    data += 256;
-    firstBlock++;
-    bl++;
-  }
-  return bl;
-}
-
-
-s_int16 FsMapSpiFlashWrite (struct FsMapper * map, u_int32 firstBlock,
-                            u_int16 blocks, u_int16 * data)
-{
-  s_int16 bl = 0;
-
-  firstBlock += RESERVED_BLOCKS;
-
-  if (shouldFlush)
-  {
-    do__not__puts ("flush-reject");
-    return 0; // don't accept write while flushing
-  }
-  while (bl < blocks)
-  {
-    // Is the block to be written different than data already in EEPROM?
-    if (EeCompareBlock (firstBlock, data))
-    {
-      __y u_int16 *target = FindCachedBlock (firstBlock);
-      if (target)
-      {
-        do__not__puthex (firstBlock);
-        do__not__puthex ((u_int16) target);
-        do__not__puts ("=rewrite_lba");
-      }
-      else
-      {
-        target = GetEmptyBlock (firstBlock);
-        do__not__puthex (firstBlock);
-        do__not__puts ("=write_lba");
-      }
-      if (!target)
-      { // cache is full
-        // must do a cache flush to get cache space
-        FsMapSpiFlashFlush (NULL, 1);
-        target = GetEmptyBlock (firstBlock);
-      }
-      if (target)
-      {
-        memcpyXY (target, data, 256);
-        PrintCache ();
-      }
-      else
-      {
-        puts ("FATAL ERROR: NO CACHE SPACE. THIS NEVER HAPPENS.");
-        while (1)
-          ;
-      }
-      WriteContinuous4K ();
-    }
-    else
-    {
-      do__not__puthex (firstBlock);
-      do__not__puts ("=lba; Redundant write skipped");
-    }
-
-    if (PERIP (USB_STATUS) & USB_STF_BUS_RESET)
-    {
-      do__not__puts ("USB: Reset");
-    };
-    data += 256;
-    firstBlock++;
-    bl++;
-  }
-  return bl;
-}
-
-
-s_int16 FsMapSpiFlashFlush (struct FsMapper * map, u_int16 hard)
-{
-  u_int16 i, j, lba;
-  u_int16 __y *dptr;
-  u_int16 newBlockPresent;
-
-  do__not__puts ("FLUSH");
-  PrintCache ();
-
-  if (shouldFlush > 1)
-    return 0;
-  shouldFlush = 2;  // flushing
-
-  for (i = 0; i < CACHE_BLOCKS; i++)
-  {
-    if (blockPresent & (1 /* was L */  << i))
-    {
-      do__not__puthex (i);
-      do__not__puthex (blockAddress[i]);
-      do__not__puts ("slot, lba  is dirty");
-      lba = blockAddress[i] & 0xfff8;
-      EeRead4KSectorYToWorkspace (lba);
-      newBlockPresent = blockPresent;
-      for (j = 0; j < 8; j++)
-      {
-        do__not__puthex (lba + j);
-        if (dptr = FindCachedBlock (lba + j))
-        {
-          memcpyYY (WORKSPACE + (256 * j), dptr, 256);
-          newBlockPresent &= ~(1 /* was L */  << lastFoundBlock);
-
-          do__not__puts ("from cache");
-        }
-        else
-        {
-          do__not__puts ("from disk");
-        }
-      }
-      if (-1 != EeProgram4K (lba, WORKSPACE))
-      {
-        blockPresent = newBlockPresent;
-        shouldFlush = 0;
-      }
-      else
-      {
-        shouldFlush = 1;
-        return 0; /* USB HAS BEEN RESET */
-      }
-    }
-  }
-  shouldFlush = 0;
-  return 0;
-
-}
 
 
 auto void MyMassStorage (void)
 {
   register __b0 int usbMode = 0;
   do__not__puts ("MyMassStorage");
+#if USE_SECTOR_CACHE
+  SectorCacheStop ();  /* the mapper needs mallocAreaY */
+#endif
 
   voltages[voltCoreUSB] = 31; // 30:ok
   voltages[voltIoUSB] = 31; // set maximum IO voltage (about 3.6V)
@@ -798,6 +218,7 @@ auto void MyMassStorage (void)
   BusyWait10 ();
   LoadCheck (NULL, 1);  /* Set 48 MHz Clock */
   SetRate (44100U);
+  FsMapSpiFlashCalibrate (1); /* fastest core clock, fastest SPI clock */
 
   SetHookFunction ((u_int16) InitUSBDescriptors, MyInitUSBDescriptors);
 
@@ -812,6 +233,7 @@ auto void MyMassStorage (void)
     {
       FsMapSpiFlashFlush (NULL, 1);
     }
+    FsMapSpiFlashStep ();
     if (USBWantsSuspend ())
     {
       if (USBIsDetached ())
@@ -833,16 +255,29 @@ auto void MyMassStorage (void)
   PERIP (SCI_STATUS) &= ~SCISTF_USB_PULLUP_ENA;
   PERIP (USB_CONFIG) = 0x8000U;
   map->Flush (map, 1);
+  usbBuffersInUse = 0;  /* the player needs mallocAreaY */
   PowerSetVoltages (&voltages[voltCorePlayer]);
 }
 
 
+#if USE_PRE_ERASE
+// Tell the mapper which sectors hold no file data
+s_int16 FreeSectors (void *private, u_int32 sector, u_int32 numSecs)
+{
+  map->Free (map, sector, numSecs);
+  return 0;
+}
+#endif
 
+#if !USE_FILE_INDEX
 // FAT12 binary patch
 auto u_int16 Fat12OpenFile (register __c0 u_int16 n);
+#endif
+
 
 void main (void)
 {
+  u_int16 freeSpaceWalked = 0; /* free map of the disk as it is now */
 
   do__not__puts ("Hello.");
 
@@ -865,7 +300,15 @@ void main (void)
   keyOld = KEY_POWER;
   keyOldTime = -32767;
 
+#if USE_FILE_INDEX
+  // Files come from the file index, the rest through the FAT12 patch
+  SetHookFunction ((u_int16) OpenFile, FileIndexOpenFile);
+#else
   SetHookFunction ((u_int16) OpenFile, Fat12OpenFile);
+#endif
+#if USE_SECTOR_CACHE
+  SetHookFunction ((u_int16) ReadDiskSector, CachedReadDiskSector);
+#endif
 
   // Set the GPIO hook to look at GPIO pins
   SetHookFunction ((u_int16) IdleHook, GPIOCtrlIdleHook);
@@ -883,17 +326,46 @@ void main (void)
     {
       do__not__puts ("MassStorage");
       MyMassStorage ();
+      freeSpaceWalked = 0;
       do__not__puts ("From MassStorage");
     }
     // puts("Test");
 
+    // Until a file is decoded, keep FAT and directory sectors in the
+    // player's memory. WORKSPACE is left for building the file index.
+#ifdef GAPLESS
+    VorbisSetupForget ();
+#endif
+#if USE_SECTOR_CACHE
+    SectorCacheStart (mallocAreaY, (WORKSPACE - mallocAreaY) / 256);
+#endif
+
     // Try to use a FAT filesystem on logical disk
     if (InitFileSystem () == 0)
     {
       minifatInfo.supportedSuffixes = defSupportedFiles;
 
+#if USE_PRE_ERASE
+      // Free space is erased while playing silence, so that the next
+      // USB session writes it at blank chip speed. The disk only
+      // changes in USB mode, so it is walked once after each session.
+      if (!freeSpaceWalked)
+      {
+        FsMapSpiFlashForgetFree ();
+        FatIterateOverFreeSectors (FreeSectors, NULL);
+        FsMapSpiFlashFreeDone ();
+        freeSpaceWalked = 1;
+      }
+#endif
+
+#if USE_FILE_INDEX
+      // Look for playable files, in the file index if the disk has not
+      // changed since it was written
+      player.totalFiles = FileIndexInit ();
+#else
       // Look for playable files
       player.totalFiles = OpenFile (0xffffU);
+#endif
       player.currentFile = 0xffffU;
       do__not__puts ("Total Files");
       do__not__puthex (player.totalFiles);
@@ -920,7 +392,15 @@ void main (void)
           {
             break;
           }
+#if USE_PRE_ERASE
+          // The audio buffer is full now: one SPI operation or a 4K
+          // blank check, never a wait for the flash
+          FsMapSpiFlashPreErase ();
+#endif
         }
+#if USE_PRE_ERASE
+        FsMapSpiFlashPreEraseSuspend (); /* the file is read right away */
+#endif
 
         if (player.currentFile < player.totalFiles && OpenFile (player.currentFile) < 0)
         {
@@ -936,7 +416,15 @@ void main (void)
             do__not__puts ("Current playing file");
             do__not__puthex (player.currentFile);
             do__not__puts ("");
+#if USE_SECTOR_CACHE
+            SectorCacheStop (); /* the decoder needs mallocAreaY */
+#endif
             ret = PLAYFILE ();  // Decode and Play.
+#if USE_SECTOR_CACHE && !defined(GAPLESS)
+            /* with GAPLESS the Vorbis setup stays for the next file */
+            SectorCacheStart (mallocAreaY,
+                              (WORKSPACE - mallocAreaY) / 256);
+#endif
             do__not__puts ("Player return value");
             do__not__puthex (ret);
             do__not__puts ("");
@@ -962,6 +450,9 @@ void main (void)
       LoadCheck (&cs, 32);
       memset (tmpBuf, 0, sizeof (tmpBuf));  /* silence */
       AudioOutputSamples (tmpBuf, sizeof (tmpBuf) / 2); /* silence */
+#if USE_PRE_ERASE
+      FsMapSpiFlashPreErase ();
+#endif
     }
   }
 }
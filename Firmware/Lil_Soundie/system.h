@@ -4,6 +4,37 @@
 // Turn on WAV Playback
 #define USE_WAV 1
 
+// Play PCM WAV files in playwavorogg.c instead of the ROM codec, looping
+// them without a gap for as long as the file stays selected
+#define USE_WAV_LOOP 1
+
+// Optional features. The code runs from the instruction RAM of the
+// VS1000B: the baseline firmware left 184 words of it free (see
+// mem_desc.available after a build in VSIDE). If the image no longer
+// links, turn some of these off.
+
+// Open trigger files through an index in the reserved area of the flash
+// instead of the directory, see fileindex.c
+#define USE_FILE_INDEX 1
+
+// Keep FAT and directory sectors in idle Y RAM while no file is being
+// decoded, see sectorcache.c
+#define USE_SECTOR_CACHE 1
+
+// Erase the free space of the disk while the player outputs silence, so
+// that the next USB session writes it at blank chip speed. A trigger
+// that comes during an erase waits for it before its file opens, up to
+// the 4K erase time of the chip, unless the SFDP tables of the chip
+// list an erase suspend command.
+#define USE_PRE_ERASE 1
+
+// Start an Ogg Vorbis file without decoding its headers again when they
+// set up the decoder the same way as those of the file played before.
+// Off by default: the sector cache (USE_SECTOR_CACHE) shares its Y RAM
+// with the kept Vorbis setup, so with GAPLESS it is stopped after the
+// first played file and the directory is read from the flash again.
+// #define GAPLESS 1
+
 // GPIO defines
 #define GPIO0_PULLUPS   0x1b80  // Audio module has pull-ups in these pins
 